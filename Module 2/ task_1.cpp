@@ -16,233 +16,2914 @@
 
 #include <iostream>
 #include <cassert>
+#include <cctype>
+#include <algorithm>
 #include <vector>
+#include <memory>
+#include <new>
+#include <cstdint>
+#include <type_traits>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HASH_TABLE_SSE2
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HASH_TABLE_MMAP
+#endif
 
 #define INITIAL_SIZE 8
+#define GROUP_WIDTH 16
+#define MIGRATION_STEP 16
+#define BATCH_SIZE 16
+#define BUILD_PARTITION_BITS 16
 
-template<typename T, typename H = std::hash<T>>
-class hash_table
+/*
+Управляющий байт ячейки: 7 бит хеша для занятой ячейки
+либо отрицательное значение для пустой и удалённой.
+*/
+const int8_t control_empty = -128;
+const int8_t control_deleted = -2;
+
+inline int8_t hash_fragment(size_t hash)
+{
+    return static_cast<int8_t>((uint64_t(hash) * 0x9E3779B97F4A7C15ull) >> 57);
+}
+
+/*
+blocking: при росте все ключи переносятся в новую таблицу сразу.
+incremental: старая и новая таблицы живут вместе, и каждая операция
+переносит не больше MIGRATION_STEP ячеек старой таблицы.
+*/
+enum class resize_mode
+{
+    blocking,
+    incremental,
+};
+
+inline void prefetch(const void* address)
+{
+#ifdef __GNUC__
+    __builtin_prefetch(address);
+#elif defined(HASH_TABLE_SSE2)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#endif
+}
+
+inline unsigned lowest_bit(uint32_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    unsigned bit = 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// GROUP_WIDTH управляющих байтов, сравниваемых за одну операцию
+class control_group
 {
 public:
-    hash_table(H hasher1, H hasher2)
-        : _table(INITIAL_SIZE), _size(0), _hasher1(hasher1), _hasher2(hasher2)
+    explicit control_group(const int8_t* control)
+    {
+#ifdef HASH_TABLE_SSE2
+        _bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+#else
+        for (size_t i = 0; i < GROUP_WIDTH; ++i)
+        {
+            _bytes[i] = control[i];
+        }
+#endif
+    }
+
+    uint32_t match(int8_t value) const
+    {
+#ifdef HASH_TABLE_SSE2
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(_bytes, _mm_set1_epi8(value)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i)
+        {
+            mask |= uint32_t(_bytes[i] == value) << i;
+        }
+        return mask;
+#endif
+    }
+
+    uint32_t match_empty() const
+    {
+        return match(control_empty);
+    }
+
+    uint32_t match_empty_or_deleted() const
+    {
+#ifdef HASH_TABLE_SSE2
+        return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), _bytes));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i)
+        {
+            mask |= uint32_t(_bytes[i] < -1) << i;
+        }
+        return mask;
+#endif
+    }
+
+private:
+#ifdef HASH_TABLE_SSE2
+    __m128i _bytes;
+#else
+    int8_t _bytes[GROUP_WIDTH];
+#endif
+};
+
+/*
+Способ хранения ключей в ячейках таблицы.
+inline_key_storage кладёт сам ключ в ячейку.
+Искомый ключ K может отличаться от T, если они сравнимы
+и T из него конструируется, например std::string_view.
+При StoreHashes == false ячейка хранит только ключ, а хеши
+пересчитываются при переносе; это выгодно для целых ключей
+с дешёвой хеш-функцией, у которых ячейка сжимается с 24 до 8 байт.
+*/
+template<typename T, bool StoreHashes = true>
+struct inline_key_storage
+{
+    typedef T stored_key;
+
+    static const bool stores_hashes = StoreHashes;
+
+    template<typename K>
+    stored_key store(const K& key)
+    {
+        return T(key);
+    }
+
+    template<typename K>
+    bool equal(const stored_key& stored, const K& key) const
+    {
+        return stored == key;
+    }
+
+    void release(const stored_key&)
     { }
 
-    ~hash_table()
+    const T& view(const stored_key& stored) const
+    {
+        return stored;
+    }
+
+    bool needs_compaction() const
+    {
+        return false;
+    }
+
+    stored_key copy_from(const inline_key_storage&, const stored_key& stored)
+    {
+        return stored;
+    }
+};
+
+/*
+Байты строк складываются подряд в чанки по ARENA_CHUNK_SIZE,
+а ячейка хранит только номер чанка, смещение и длину в 8 байтах.
+Перехеширование переносит их и не трогает сами строки.
+Место удалённых строк возвращается при сжатии арены,
+когда мёртвых байтов становится больше живых.
+*/
+#define ARENA_CHUNK_SIZE (1 << 16)
+
+class string_arena_storage
+{
+public:
+    // Смещение помещается в 16 бит, так как чанк не больше 64 КиБ;
+    // строка длиннее ARENA_CHUNK_SIZE / 4 лежит в своём чанке.
+    // Длина от long_length и больше не помещается в 24 бита: она пишется
+    // в первые 8 байт такого чанка, а строка идёт за ней
+    struct stored_key
+    {
+        uint64_t chunk : 24;
+        uint64_t offset : 16;
+        uint64_t length : 24;
+    };
+
+    static const bool stores_hashes = true;
+
+    string_arena_storage()
+        : _current_chunk(0), _chunk_used(ARENA_CHUNK_SIZE), _live_bytes(0), _dead_bytes(0)
     { }
 
-    hash_table(const hash_table& t) = delete;
-    hash_table& operator=(const hash_table& t) = delete;
+    stored_key store(std::string_view key)
+    {
+        return _store(key.data(), key.size());
+    }
 
-    hash_table(hash_table&& t) = delete;
-    hash_table& operator=(hash_table&& t) = delete;
+    bool equal(const stored_key& stored, std::string_view key) const
+    {
+        return length(stored) == key.size() &&
+               std::memcmp(data(stored), key.data(), key.size()) == 0;
+    }
+
+    void release(const stored_key& stored)
+    {
+        _live_bytes -= length(stored);
+        _dead_bytes += length(stored);
+    }
+
+    bool needs_compaction() const
+    {
+        return _dead_bytes > ARENA_CHUNK_SIZE && _dead_bytes > _live_bytes;
+    }
+
+    stored_key copy_from(const string_arena_storage& source, const stored_key& stored)
+    {
+        return _store(source.data(stored), source.length(stored));
+    }
 
-    bool add_key(const T& key)
+    // Пустая строка не занимает места в чанках, и чанков может ещё не быть
+    const char* data(const stored_key& stored) const
     {
-        if (_size >= _table.size() * 0.75)
+        if (stored.length == 0)
         {
-            _grow_table();
+            return "";
         }
 
-        size_t table_size = _table.size();
-        size_t hash1 = _hasher1(key) % table_size;
-        size_t hash2 = (_hasher2(key) * 2 + 1) % table_size;
+        return _chunks[stored.chunk].get() + stored.offset;
+    }
+
+    size_t length(const stored_key& stored) const
+    {
+        if (stored.length != long_length)
+            return stored.length;
+
+        uint64_t length;
+        std::memcpy(&length, _chunks[stored.chunk].get(), sizeof(length));
+        return length;
+    }
+
+    std::string_view view(const stored_key& stored) const
+    {
+        return std::string_view(data(stored), length(stored));
+    }
 
-        if (hash2 == 0) hash2 = 1;
+private:
+    static constexpr uint64_t long_length = (1 << 24) - 1;
+
+    std::vector<std::unique_ptr<char[]>> _chunks;
+    size_t _current_chunk;
+    size_t _chunk_used;
+    size_t _live_bytes;
+    size_t _dead_bytes;
 
-        size_t first_deleted_pos = table_size;
-        bool found_deleted = false;
-        size_t pos = hash1;
+    // Длинная строка получает собственный чанк, а текущий остаётся открытым
+    stored_key _store(const char* bytes, size_t length)
+    {
+        stored_key stored = { 0, 0, std::min<uint64_t>(length, long_length) };
 
-        for (size_t  i = 0; i < table_size; ++i)
+        if (length == 0)
         {
-            auto& cell = _table[pos];
-            if (cell.cell_state == hash_table_cell::empty)
-            {
-                if (found_deleted)
-                {
-                    pos = first_deleted_pos;
-                }
-                _table[pos].key = key;
-                _table[pos].hash = hash1;
-                _table[pos].cell_state = hash_table_cell::has_key;
-                _size++;
-                return true;
-            }
-            else if (cell.cell_state == hash_table_cell::deleted)
-            {
-                if (!found_deleted)
-                {
-                    first_deleted_pos = pos;
-                    found_deleted = true;
-                }
-            }
-            else if (cell.cell_state == hash_table_cell::has_key)
-            {
-                if (cell.key == key)
-                {
-                    return false;
-                }
-            }
-            pos = (hash1 + i * hash2) % table_size;
+            return stored;
         }
 
-        if (found_deleted)
+        if (length >= long_length)
         {
-            _table[first_deleted_pos].key = key;
-            _table[first_deleted_pos].hash = hash1;
-            _table[first_deleted_pos].cell_state = hash_table_cell::has_key;
-            _size++;
-            return true;
+            uint64_t full_length = length;
+            _chunks.emplace_back(new char[sizeof(full_length) + length]);
+            std::memcpy(_chunks.back().get(), &full_length, sizeof(full_length));
+            stored.chunk = _chunks.size() - 1;
+            stored.offset = sizeof(full_length);
+        }
+        else if (length > ARENA_CHUNK_SIZE / 4)
+        {
+            _chunks.emplace_back(new char[length]);
+            stored.chunk = _chunks.size() - 1;
+        }
+        else
+        {
+            if (_chunk_used + length > ARENA_CHUNK_SIZE)
+            {
+                _chunks.emplace_back(new char[ARENA_CHUNK_SIZE]);
+                _current_chunk = _chunks.size() - 1;
+                _chunk_used = 0;
+            }
+
+            stored.chunk = _current_chunk;
+            stored.offset = _chunk_used;
+            _chunk_used += length;
         }
 
-        return false;
+        std::memcpy(_chunks[stored.chunk].get() + stored.offset, bytes, length);
+        _live_bytes += length;
+        return stored;
+    }
+};
+
+/*
+Массив ячеек и их управляющие байты. Ячейка сконструирована, только пока
+её управляющий байт неотрицателен, поэтому выделение новой таблицы
+не обходит все ячейки.
+Ячейка Cell хранит key, а hash_equal(hash) отсеивает ключи с другим
+хешем до сравнения самих ключей.
+Ячейки хранятся отдельно от управляющих байтов. Шаг пробирования
+проверяет сразу GROUP_WIDTH байтов начиная с позиции, а к ключам
+обращается только при совпадении 7 бит хеша. Первые GROUP_WIDTH - 1
+управляющих байтов продублированы после конца массива, чтобы группа
+читалась одной загрузкой в любой позиции.
+*/
+template<typename Cell>
+struct double_hashing_table
+{
+    explicit double_hashing_table(size_t size = 0)
+        : cells(size ? std::allocator<Cell>().allocate(size) : nullptr),
+          capacity(size), deleted(0), control(size + GROUP_WIDTH - 1, control_empty)
+    { }
+
+    ~double_hashing_table()
+    {
+        clear();
+    }
+
+    double_hashing_table(const double_hashing_table& t) = delete;
+    double_hashing_table& operator=(const double_hashing_table& t) = delete;
+
+    double_hashing_table(double_hashing_table&& t)
+        : double_hashing_table()
+    {
+        swap(t);
+    }
+
+    double_hashing_table& operator=(double_hashing_table&& t)
+    {
+        double_hashing_table(std::move(t)).swap(*this);
+        return *this;
+    }
+
+    void swap(double_hashing_table& t)
+    {
+        std::swap(cells, t.cells);
+        std::swap(capacity, t.capacity);
+        std::swap(deleted, t.deleted);
+        std::swap(control, t.control);
     }
 
-    bool delete_key(const T& key)
+    size_t size() const
     {
-        size_t table_size = _table.size();
-        size_t hash1 = _hasher1(key) % table_size;
-        size_t hash2 = (_hasher2(key) * 2 + 1) % table_size;
+        return capacity;
+    }
+
+    bool occupied(size_t pos) const
+    {
+        return control[pos] >= 0;
+    }
 
-        if (hash2 == 0) hash2 = 1;
+    // Позиция, с которой перенос обходит таблицу в обратном порядке
+    size_t migration_start() const
+    {
+        return 0;
+    }
 
-        size_t pos = hash1;
+    void prefetch_home(size_t hash) const
+    {
+        size_t pos = hash & mask();
+        prefetch(&control[pos]);
+        prefetch(&cells[pos]);
+    }
 
-        for (size_t i = 0; i < table_size; ++i)
+    void clear()
+    {
+        if (!cells)
         {
-            auto& cell = _table[pos];
+            return;
+        }
 
-            if (cell.cell_state == hash_table_cell::empty)
+        for (size_t pos = 0; pos < capacity; ++pos)
+        {
+            if (occupied(pos))
             {
-                return false;
+                cells[pos].~Cell();
             }
+        }
 
-            else if (cell.cell_state == hash_table_cell::has_key && cell.key == key)
-            {
-                cell.cell_state = hash_table_cell::deleted;
-                _size--;
-                return true;
-            }
+        release();
+    }
+
+    // Освобождает память, не обходя ячейки; все ячейки должны быть уже разрушены
+    void release()
+    {
+        std::allocator<Cell>().deallocate(cells, capacity);
+        cells = nullptr;
+        capacity = 0;
+        deleted = 0;
+        std::vector<int8_t>(GROUP_WIDTH - 1, control_empty).swap(control);
+    }
+
+    /*
+    Размер таблицы всегда степень двойки, поэтому позиции берутся по маске.
+    Нечётный шаг взаимно прост с размером, и последовательность
+    pos, pos + step, ... обходит все позиции без повторов.
+    */
+    size_t mask() const
+    {
+        return capacity - 1;
+    }
+
+    size_t probe_step(size_t step_hash) const
+    {
+        return (step_hash * 2 + 1) & mask();
+    }
+
+    void set_control(size_t pos, int8_t value)
+    {
+        control[pos] = value;
 
-            pos = (hash1 + i * hash2) % table_size;
+        for (size_t clone = pos; clone < GROUP_WIDTH - 1; clone += capacity)
+        {
+            control[capacity + clone] = value;
         }
+    }
 
-        return false;
+    // Позиция ключа в таблице или size(), если ключа нет.
+    // equal сравнивает хранимый ключ с искомым
+    template<typename Equal>
+    size_t find(size_t hash, size_t step_hash, Equal equal) const
+    {
+        size_t probes = 0;
+        return find(hash, step_hash, equal, probes);
     }
 
-    bool has_key(const T& key)
+    // probes получает число просмотренных групп
+    template<typename Equal>
+    size_t find(size_t hash, size_t step_hash, Equal equal, size_t& probes) const
     {
-        size_t table_size = _table.size();
-        size_t hash1 = _hasher1(key) % table_size;
-        size_t hash2 = (_hasher2(key) * 2 + 1) % table_size;
+        size_t step = probe_step(step_hash);
 
-        if (hash2 == 0) hash2 = 1;
+        int8_t fragment = hash_fragment(hash);
+        size_t pos = hash & mask();
 
-        size_t pos = hash1;
-        for (size_t i = 0; i < table_size; ++i)
+        for (size_t i = 0; i < capacity; ++i)
         {
-            const auto& cell = _table[pos];
+            control_group group(&control[pos]);
+            ++probes;
 
-            if (cell.cell_state == hash_table_cell::empty)
+            for (uint32_t match = group.match(fragment); match != 0; match &= match - 1)
             {
-                return false;
+                size_t candidate = (pos + lowest_bit(match)) & mask();
+                if (cells[candidate].hash_equal(hash) && equal(cells[candidate].key))
+                {
+                    return candidate;
+                }
             }
 
-            if (cell.cell_state == hash_table_cell::has_key && cell.key == key)
+            if (group.match_empty() != 0)
             {
-                return true;
+                return capacity;
             }
 
-            pos = (hash1 + i * hash2) % table_size;
+            pos = (pos + step) & mask();
         }
-        return false;
-    }
 
-private:
-    H _hasher1;
-    H _hasher2;
+        return capacity;
+    }
 
-    struct hash_table_cell
+    // Первая свободная ячейка на пути пробирования; в таблице без удалённых
+    // ячеек и дубликатов это место, куда ключ поставил бы find_or_prepare_insert
+    size_t find_free_slot(size_t hash, size_t step_hash) const
     {
-        T key;
-        size_t hash = 0;
+        size_t step = probe_step(step_hash);
+        size_t pos = hash & mask();
 
-        enum cell_state {
-            empty,
-            deleted,
-            has_key,
-        } cell_state = empty;
-    };
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            uint32_t free_slots = control_group(&control[pos]).match_empty_or_deleted();
+            if (free_slots != 0)
+            {
+                return (pos + lowest_bit(free_slots)) & mask();
+            }
 
-    std::vector<hash_table_cell> _table;
+            pos = (pos + step) & mask();
+        }
 
-    size_t _size;
+        return capacity;
+    }
 
-    void _grow_table()
+    // Позиция найденного ключа либо ячейка, в которую его нужно поставить.
+    // Если свободной ячейки нет, возвращается size()
+    template<typename Equal>
+    size_t find_or_prepare_insert(size_t hash, size_t step_hash, Equal equal, bool& found) const
     {
-        std::vector<hash_table_cell> old_table = std::move(_table);
-        size_t new_size = old_table.size() * 2;
+        size_t step = probe_step(step_hash);
 
-        _table.resize(new_size);
-        _size = 0;
+        int8_t fragment = hash_fragment(hash);
+        size_t insert_pos = capacity;
+        size_t pos = hash & mask();
+        found = false;
 
-        for (const auto& cell : old_table)
+        for (size_t i = 0; i < capacity; ++i)
         {
-            if (cell.cell_state == hash_table_cell::has_key)
+            control_group group(&control[pos]);
+
+            for (uint32_t match = group.match(fragment); match != 0; match &= match - 1)
+            {
+                size_t candidate = (pos + lowest_bit(match)) & mask();
+                if (cells[candidate].hash_equal(hash) && equal(cells[candidate].key))
+                {
+                    found = true;
+                    return candidate;
+                }
+            }
+
+            if (insert_pos == capacity)
             {
-                add_key(cell.key);
+                uint32_t free_slots = group.match_empty_or_deleted();
+                if (free_slots != 0)
+                {
+                    insert_pos = (pos + lowest_bit(free_slots)) & mask();
+                }
+            }
+
+            if (group.match_empty() != 0)
+            {
+                break;
             }
+
+            pos = (pos + step) & mask();
         }
-    }
-};
 
-struct string_hasher
-{
-    string_hasher(size_t p = 101)
-        : _p(p)
-    { }
+        return insert_pos;
+    }
 
-    size_t operator()(const std::string& key) const
+    void emplace(size_t pos, Cell&& cell, size_t hash)
     {
-        size_t hash = 1;
-        for (const char& a : key)
+        if (control[pos] == control_deleted)
         {
-            hash = hash * _p + a;
+            deleted--;
         }
 
-        return hash;
+        int8_t fragment = hash_fragment(hash);
+        new (&cells[pos]) Cell(std::move(cell));
+        set_control(pos, fragment);
     }
 
-private:
-    size_t _p;
+    void remove(size_t pos)
+    {
+        cells[pos].~Cell();
+        set_control(pos, control_deleted);
+        deleted++;
+    }
+
+    // Ставит ячейку без проверки дубликатов
+    void place(Cell&& cell, size_t hash, size_t step_hash)
+    {
+        emplace(find_free_slot(hash, step_hash), std::move(cell), hash);
+    }
+
+    Cell* cells;
+    size_t capacity;
+    size_t deleted;
+    std::vector<int8_t> control;
 };
 
-void run(std::istream& in, std::ostream& out)
+
+/*
+Линейное пробирование Robin Hood. distance[pos] равно 0 для пустой ячейки,
+иначе 1 + расстояние ключа от его домашней позиции. Ключи в цепочке идут
+по возрастанию домашней позиции, поэтому поиск останавливается, как только
+встречает ключ ближе к дому, чем искомый был бы здесь. Удаление сдвигает
+хвост цепочки назад, и удалённых ячеек не остаётся. step_hash не нужен.
+*/
+template<typename Cell>
+struct robin_hood_table
 {
-    hash_table<std::string, decltype(string_hasher())> set(string_hasher(101), string_hasher(103));
+    explicit robin_hood_table(size_t size = 0)
+        : cells(size ? std::allocator<Cell>().allocate(size) : nullptr),
+          capacity(size), deleted(0), distance(size, 0)
+    { }
 
-    char op = '\0';
-    std::string word;
+    ~robin_hood_table()
+    {
+        clear();
+    }
+
+    robin_hood_table(const robin_hood_table& t) = delete;
+    robin_hood_table& operator=(const robin_hood_table& t) = delete;
 
-    while (in >> op >> word)
+    robin_hood_table(robin_hood_table&& t)
+        : robin_hood_table()
     {
-        switch (op)
-        {
-        case '+':
-            out << (set.add_key(word) ? "OK" : "FAIL") << '\n';
-            break;
-        case '-':
-            out << (set.delete_key(word) ? "OK" : "FAIL") << '\n';
-            break;
-        case '?':
-            out << (set.has_key(word) ? "OK" : "FAIL") << '\n';
-            break;
-        }
+        swap(t);
+    }
+
+    robin_hood_table& operator=(robin_hood_table&& t)
+    {
+        robin_hood_table(std::move(t)).swap(*this);
+        return *this;
     }
-}
 
+    void swap(robin_hood_table& t)
+    {
+        std::swap(cells, t.cells);
+        std::swap(capacity, t.capacity);
+        std::swap(deleted, t.deleted);
+        std::swap(distance, t.distance);
+    }
+
+    size_t size() const
+    {
+        return capacity;
+    }
+
+    size_t mask() const
+    {
+        return capacity - 1;
+    }
+
+    bool occupied(size_t pos) const
+    {
+        return distance[pos] != 0;
+    }
+
+    /*
+    Перенос идёт в обратном порядке от пустой ячейки. Тогда к моменту
+    удаления ключа все следующие за ним в цепочке уже перенесены,
+    и сдвиг назад не затягивает непройденные ключи в пройденную часть.
+    */
+    size_t migration_start() const
+    {
+        size_t pos = 0;
+        while (occupied(pos))
+        {
+            ++pos;
+        }
+        return pos;
+    }
+
+    void prefetch_home(size_t hash) const
+    {
+        size_t pos = hash & mask();
+        prefetch(&distance[pos]);
+        prefetch(&cells[pos]);
+    }
+
+    void clear()
+    {
+        if (!cells)
+        {
+            return;
+        }
+
+        for (size_t pos = 0; pos < capacity; ++pos)
+        {
+            if (occupied(pos))
+            {
+                cells[pos].~Cell();
+            }
+        }
+
+        release();
+    }
+
+    void release()
+    {
+        std::allocator<Cell>().deallocate(cells, capacity);
+        cells = nullptr;
+        capacity = 0;
+        std::vector<uint32_t>().swap(distance);
+    }
+
+    template<typename Equal>
+    size_t find(size_t hash, size_t step_hash, Equal equal) const
+    {
+        size_t probes = 0;
+        return find(hash, step_hash, equal, probes);
+    }
+
+    // probes получает число просмотренных ячеек
+    template<typename Equal>
+    size_t find(size_t hash, size_t, Equal equal, size_t& probes) const
+    {
+        size_t pos = hash & mask();
+
+        for (uint32_t d = 1; ; ++d)
+        {
+            ++probes;
+            if (distance[pos] < d)
+            {
+                return capacity;
+            }
+            if (cells[pos].hash_equal(hash) && equal(cells[pos].key))
+            {
+                return pos;
+            }
+            pos = (pos + 1) & mask();
+        }
+    }
+
+    // Позиция найденного ключа либо ячейка, куда его нужно вставить со сдвигом хвоста
+    template<typename Equal>
+    size_t find_or_prepare_insert(size_t hash, size_t, Equal equal, bool& found) const
+    {
+        size_t pos = hash & mask();
+        found = false;
+
+        for (uint32_t d = 1; distance[pos] >= d; ++d)
+        {
+            if (cells[pos].hash_equal(hash) && equal(cells[pos].key))
+            {
+                found = true;
+                return pos;
+            }
+            pos = (pos + 1) & mask();
+        }
+
+        return pos;
+    }
+
+    // Сдвигает цепочку с pos на одну ячейку вперёд до первой пустой и ставит cell в pos
+    void emplace(size_t pos, Cell&& cell, size_t hash)
+    {
+        size_t end = pos;
+        while (occupied(end))
+        {
+            end = (end + 1) & mask();
+        }
+
+        while (end != pos)
+        {
+            size_t prev = (end - 1) & mask();
+            new (&cells[end]) Cell(std::move(cells[prev]));
+            cells[prev].~Cell();
+            distance[end] = distance[prev] + 1;
+            end = prev;
+        }
+
+        distance[pos] = uint32_t(((pos - hash) & mask()) + 1);
+        new (&cells[pos]) Cell(std::move(cell));
+    }
+
+    void remove(size_t pos)
+    {
+        cells[pos].~Cell();
+
+        size_t next = (pos + 1) & mask();
+        while (distance[next] > 1)
+        {
+            new (&cells[pos]) Cell(std::move(cells[next]));
+            cells[next].~Cell();
+            distance[pos] = distance[next] - 1;
+            pos = next;
+            next = (pos + 1) & mask();
+        }
+
+        distance[pos] = 0;
+    }
+
+    void place(Cell&& cell, size_t hash, size_t step_hash)
+    {
+        bool found = false;
+        size_t pos = find_or_prepare_insert(hash, step_hash,
+                                            [](const decltype(cell.key)&) { return false; }, found);
+        emplace(pos, std::move(cell), hash);
+    }
+
+    Cell* cells;
+    size_t capacity;
+    size_t deleted;
+    std::vector<uint32_t> distance;
+};
+
+// Политики пробирования для параметра P таблицы hash_table
+struct double_hashing
+{
+    template<typename Cell>
+    using table = double_hashing_table<Cell>;
+};
+
+struct robin_hood_probing
+{
+    template<typename Cell>
+    using table = robin_hood_table<Cell>;
+};
+
+/*
+Статистика таблицы включается макросом HASH_TABLE_STATS. Без него
+счётчики заменяются пустой структурой, вызовы которой компилятор
+выбрасывает, и поиск не делает лишней работы.
+*/
+#ifdef HASH_TABLE_STATS
+#define PROBE_HISTOGRAM_SIZE 16
+
+// Столбец i гистограммы считает поиски длиной i + 1 шаг, последний —
+// все длиной от PROBE_HISTOGRAM_SIZE. Шаг при двойном хешировании —
+// группа из GROUP_WIDTH управляющих байтов, при Robin Hood — одна ячейка,
+// поэтому гистограммы разных политик напрямую не сравниваются.
+// Время перехеширования включает перенос ячеек
+struct hash_table_stats
+{
+    size_t size;
+    size_t capacity;
+    double load;
+    size_t deleted;
+    size_t hit_probes[PROBE_HISTOGRAM_SIZE];
+    size_t miss_probes[PROBE_HISTOGRAM_SIZE];
+    size_t rehash_count;
+    double rehash_seconds;
+};
+
+// Атомарные счётчики, так как поиск в concurrent_hash_table идёт под общей блокировкой
+class table_counters
+{
+public:
+    typedef std::chrono::steady_clock::time_point timer;
+
+    // Поиск всегда делает хотя бы один шаг, так что probes >= 1
+    void record_lookup(bool found, size_t probes) const
+    {
+        std::atomic<size_t>* histogram = found ? _hit_probes : _miss_probes;
+        histogram[std::min<size_t>(probes, PROBE_HISTOGRAM_SIZE) - 1].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record_rehash()
+    {
+        _rehash_count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    timer start_timer() const
+    {
+        return std::chrono::steady_clock::now();
+    }
+
+    void record_rehash_time(timer start)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        _rehash_nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                                      std::memory_order_relaxed);
+    }
+
+    void fill(hash_table_stats& stats) const
+    {
+        for (size_t i = 0; i < PROBE_HISTOGRAM_SIZE; ++i)
+        {
+            stats.hit_probes[i] = _hit_probes[i].load(std::memory_order_relaxed);
+            stats.miss_probes[i] = _miss_probes[i].load(std::memory_order_relaxed);
+        }
+
+        stats.rehash_count = _rehash_count.load(std::memory_order_relaxed);
+        stats.rehash_seconds = _rehash_nanoseconds.load(std::memory_order_relaxed) * 1e-9;
+    }
+
+private:
+    mutable std::atomic<size_t> _hit_probes[PROBE_HISTOGRAM_SIZE] = {};
+    mutable std::atomic<size_t> _miss_probes[PROBE_HISTOGRAM_SIZE] = {};
+    std::atomic<size_t> _rehash_count = {0};
+    std::atomic<uint64_t> _rehash_nanoseconds = {0};
+};
+#else
+class table_counters
+{
+public:
+    typedef int timer;
+
+    void record_lookup(bool, size_t) const
+    { }
+
+    void record_rehash()
+    { }
+
+    timer start_timer() const
+    {
+        return 0;
+    }
+
+    void record_rehash_time(timer)
+    { }
+};
+#endif
+
+template<typename T, typename H, typename S, typename P>
+class concurrent_hash_table;
+
+/*
+Раскладку ячеек и порядок пробирования задаёт политика P: double_hashing
+(управляющие байты и двойное хеширование) или robin_hood_probing
+(линейное пробирование Robin Hood). Сама таблица отвечает за хеширование,
+хранение ключей, рост и перехеширование, одинаковые для обеих политик.
+*/
+template<typename T, typename H = std::hash<T>, typename S = inline_key_storage<T>,
+         typename P = double_hashing>
+class hash_table
+{
+public:
+    hash_table(H hasher1, H hasher2, resize_mode mode = resize_mode::blocking)
+        : _hasher1(hasher1), _hasher2(hasher2), _single_hash(false),
+          _table(INITIAL_SIZE), _compacting_storage(false), _size(0), _mode(mode),
+          _migrate_pos(0), _migrate_start(0),
+          _min_size(INITIAL_SIZE)
+    { }
+
+    // Шаг двойного хеширования берётся из того же 64-битного значения,
+    // поэтому хеш-функция должна хорошо перемешивать все биты
+    explicit hash_table(H hasher, resize_mode mode = resize_mode::blocking)
+        : _hasher1(hasher), _hasher2(hasher), _single_hash(true),
+          _table(INITIAL_SIZE), _compacting_storage(false), _size(0), _mode(mode),
+          _migrate_pos(0), _migrate_start(0),
+          _min_size(INITIAL_SIZE)
+    { }
+
+    /*
+    Построение из диапазона ключей с произвольным доступом. Таблица
+    сразу получает итоговый размер, хеши считаются в threads потоках,
+    а ключи вставляются в порядке старших бит их начальной позиции,
+    так что запись идёт по таблице почти подряд. Повторы не добавляются.
+    */
+    template<typename It>
+    hash_table(It first, It last, H hasher1, H hasher2,
+               resize_mode mode = resize_mode::blocking, size_t threads = 1)
+        : hash_table(hasher1, hasher2, mode)
+    {
+        _build(first, last, threads);
+    }
+
+    template<typename It>
+    hash_table(It first, It last, H hasher,
+               resize_mode mode = resize_mode::blocking, size_t threads = 1)
+        : hash_table(hasher, mode)
+    {
+        _build(first, last, threads);
+    }
+
+    ~hash_table()
+    { }
+
+    hash_table(const hash_table& t) = delete;
+    hash_table& operator=(const hash_table& t) = delete;
+
+    hash_table(hash_table&& t) = delete;
+    hash_table& operator=(hash_table&& t) = delete;
+
+    // Готовит место под n ключей без перехеширования и не даёт
+    // сжатию после удалений опустить таблицу ниже этого размера
+    void reserve(size_t n)
+    {
+        size_t new_size = INITIAL_SIZE;
+        while (n * 4 > new_size * 3)
+        {
+            new_size *= 2;
+        }
+
+        _min_size = new_size;
+
+        if (new_size > _table.size())
+        {
+            _rehash(new_size);
+            _finish_migration();
+        }
+    }
+
+    /*
+    Операции принимают любой ключ K, который понимают хеш-функция и хранилище.
+    Для строк это std::string_view: поиск и удаление по нему не выделяют память,
+    а добавление копирует строку только при вставке.
+    */
+    template<typename K = T>
+    bool add_key(const K& key)
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+
+        return _add_hashed(key, hash, step_hash);
+    }
+
+    template<typename K = T>
+    bool delete_key(const K& key)
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+
+        return _delete_hashed(key, hash, step_hash);
+    }
+
+    template<typename K = T>
+    bool has_key(const K& key)
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+
+        return _has_hashed(key, hash, step_hash);
+    }
+
+    // Поиск без переноса ячеек при incremental resize, поэтому он не меняет таблицу
+    template<typename K = T>
+    bool contains(const K& key) const
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+
+        return _contains_hashed(key, hash, step_hash);
+    }
+
+    /*
+    Пакетные операции над диапазоном ключей [first, last). Ключи берутся
+    по BATCH_SIZE: сначала считаются хеши и запрашиваются в кеш начальные
+    группы и ячейки, затем разрешаются пробирования, так что промахи
+    кеша для ключей пакета перекрываются.
+    */
+    template<typename It>
+    void has_keys(It first, It last, std::vector<bool>& found)
+    {
+        found.clear();
+
+        size_t hashes[BATCH_SIZE];
+        size_t step_hashes[BATCH_SIZE];
+
+        while (first != last)
+        {
+            It batch_first = first;
+            size_t count = _prepare_batch(first, last, hashes, step_hashes);
+
+            for (size_t i = 0; i < count; ++i, ++batch_first)
+            {
+                found.push_back(_has_hashed(*batch_first, hashes[i], step_hashes[i]));
+            }
+        }
+    }
+
+    // Возвращает число добавленных ключей
+    template<typename It>
+    size_t add_keys(It first, It last)
+    {
+        size_t added = 0;
+
+        size_t hashes[BATCH_SIZE];
+        size_t step_hashes[BATCH_SIZE];
+
+        while (first != last)
+        {
+            It batch_first = first;
+            size_t count = _prepare_batch(first, last, hashes, step_hashes);
+
+            for (size_t i = 0; i < count; ++i, ++batch_first)
+            {
+                added += _add_hashed(*batch_first, hashes[i], step_hashes[i]);
+            }
+        }
+
+        return added;
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    // Обходит ключи обеих таблиц; перенесённые ячейки из старой уже удалены
+    template<typename F>
+    void for_each_key(F f) const
+    {
+        _for_each_key(_table, f);
+        _for_each_key(_old_table, f);
+    }
+
+#ifdef HASH_TABLE_STATS
+    // Загрузка и удалённые ячейки считаются по новой таблице
+    hash_table_stats stats() const
+    {
+        hash_table_stats result;
+
+        result.size = _size;
+        result.capacity = _table.size();
+        result.load = double(_size) / _table.size();
+        result.deleted = _table.deleted;
+        _counters.fill(result);
+
+        return result;
+    }
+#endif
+
+private:
+    friend class concurrent_hash_table<T, H, S, P>;
+
+    typedef typename S::stored_key stored_key;
+
+    // Полные значения обоих хешей, чтобы сравнивать их до ключей
+    // и перехешировать таблицу без повторного вычисления хеш-функций
+    struct hashed_cell
+    {
+        stored_key key;
+        size_t hash = 0;
+        size_t step_hash = 0;
+
+        bool hash_equal(size_t other) const
+        {
+            return hash == other;
+        }
+    };
+
+    // Только ключ: сравнивается сразу он, хеши пересчитываются при переносе
+    struct bare_cell
+    {
+        stored_key key;
+
+        bool hash_equal(size_t) const
+        {
+            return true;
+        }
+    };
+
+    typedef typename std::conditional<S::stores_hashes, hashed_cell, bare_cell>::type hash_table_cell;
+
+    typedef typename P::template table<hash_table_cell> table_data;
+
+    H _hasher1;
+    H _hasher2;
+    bool _single_hash;
+
+    S _storage;
+    table_data _table;
+    table_data _old_table;
+
+    // При сжатии хранилища в incremental режиме ключи старой таблицы
+    // остаются в _old_storage и переписываются в _storage при переносе
+    S _old_storage;
+    bool _compacting_storage;
+
+    size_t _size;
+
+    resize_mode _mode;
+    size_t _migrate_pos;
+    size_t _migrate_start;
+
+    size_t _min_size;
+
+    table_counters _counters;
+
+    template<typename K>
+    size_t _hash(const K& key, size_t& step_hash) const
+    {
+        size_t hash = _hasher1(key);
+        step_hash = _single_hash ? (hash >> 32 | hash << 32) : _hasher2(key);
+        return hash;
+    }
+
+    static hash_table_cell _make_cell(stored_key key, size_t hash, size_t step_hash)
+    {
+        if constexpr (S::stores_hashes)
+        {
+            return hash_table_cell{ std::move(key), hash, step_hash };
+        }
+        else
+        {
+            return hash_table_cell{ std::move(key) };
+        }
+    }
+
+    // Хеши ячейки, ключ которой уже лежит в _storage
+    size_t _cell_hash(const hash_table_cell& cell, size_t& step_hash) const
+    {
+        if constexpr (S::stores_hashes)
+        {
+            step_hash = cell.step_hash;
+            return cell.hash;
+        }
+        else
+        {
+            return _hash(_storage.view(cell.key), step_hash);
+        }
+    }
+
+    const S& _storage_of(const table_data& table) const
+    {
+        return _compacting_storage && &table == &_old_table ? _old_storage : _storage;
+    }
+
+    S& _storage_of(const table_data& table)
+    {
+        return _compacting_storage && &table == &_old_table ? _old_storage : _storage;
+    }
+
+    template<typename K>
+    auto _key_equal(const table_data& table, const K& key) const
+    {
+        const S& storage = _storage_of(table);
+        return [&storage, &key](const stored_key& stored) { return storage.equal(stored, key); };
+    }
+
+    template<typename K>
+    bool _erase(table_data& table, const K& key, size_t hash, size_t step_hash)
+    {
+        size_t pos = table.find(hash, step_hash, _key_equal(table, key));
+        if (pos == table.size())
+        {
+            return false;
+        }
+
+        _storage_of(table).release(table.cells[pos].key);
+        table.remove(pos);
+        return true;
+    }
+
+    template<typename K>
+    bool _add_hashed(const K& key, size_t hash, size_t step_hash)
+    {
+        _migrate_step();
+
+        // Удалённые ячейки тоже удлиняют пробирование, поэтому считаются заполненными.
+        // Если заполнение в основном из них, таблица перестраивается без роста
+        if (_size + _table.deleted >= _table.size() * 0.75)
+        {
+            _rehash(_size >= _table.size() * 0.375 ? _table.size() * 2 : _table.size());
+        }
+
+        if (_is_migrating() && _old_table.find(hash, step_hash, _key_equal(_old_table, key)) != _old_table.size())
+        {
+            return false;
+        }
+
+        bool found = false;
+        size_t pos = _table.find_or_prepare_insert(hash, step_hash, _key_equal(_table, key), found);
+        if (found || pos == _table.size())
+        {
+            return false;
+        }
+
+        _table.emplace(pos, _make_cell(_storage.store(key), hash, step_hash), hash);
+        _size++;
+        return true;
+    }
+
+    template<typename K>
+    bool _delete_hashed(const K& key, size_t hash, size_t step_hash)
+    {
+        _migrate_step();
+
+        if (_erase(_table, key, hash, step_hash) ||
+            (_is_migrating() && _erase(_old_table, key, hash, step_hash)))
+        {
+            _size--;
+            _compact_table();
+            return true;
+        }
+
+        return false;
+    }
+
+
+    template<typename K>
+    bool _has_hashed(const K& key, size_t hash, size_t step_hash)
+    {
+        _migrate_step();
+
+        return _contains_hashed(key, hash, step_hash);
+    }
+
+    template<typename K>
+    bool _contains_hashed(const K& key, size_t hash, size_t step_hash) const
+    {
+        size_t probes = 0;
+
+        bool found = _table.find(hash, step_hash, _key_equal(_table, key), probes) != _table.size() ||
+                     (_is_migrating() &&
+                      _old_table.find(hash, step_hash, _key_equal(_old_table, key), probes) != _old_table.size());
+
+        _counters.record_lookup(found, probes);
+        return found;
+    }
+
+    // Хеширует до BATCH_SIZE ключей, сдвигая first, и запрашивает их начальные позиции
+    template<typename It>
+    size_t _prepare_batch(It& first, It last, size_t* hashes, size_t* step_hashes) const
+    {
+        size_t count = 0;
+
+        for (; first != last && count < BATCH_SIZE; ++first, ++count)
+        {
+            hashes[count] = _hash(*first, step_hashes[count]);
+
+            _table.prefetch_home(hashes[count]);
+        }
+
+        return count;
+    }
+
+    template<typename F>
+    void _for_each_key(const table_data& table, F& f) const
+    {
+        for (size_t pos = 0; pos < table.size(); ++pos)
+        {
+            if (table.occupied(pos))
+            {
+                f(_storage_of(table).view(table.cells[pos].key));
+            }
+        }
+    }
+
+    template<typename It>
+    void _build(It first, It last, size_t threads)
+    {
+        size_t count = size_t(last - first);
+        reserve(count);
+
+        std::vector<size_t> hashes(count);
+        std::vector<size_t> step_hashes(count);
+
+        auto hash_range = [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                hashes[i] = _hash(first[i], step_hashes[i]);
+            }
+        };
+
+        threads = std::max<size_t>(1, std::min(threads, count / BATCH_SIZE));
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; ++t)
+        {
+            workers.emplace_back(hash_range, count * t / threads, count * (t + 1) / threads);
+        }
+        hash_range(0, count / threads);
+
+        for (std::thread& worker : workers)
+        {
+            worker.join();
+        }
+
+        // Сортировка подсчётом по старшим битам начальной позиции
+        size_t position_bits = 0;
+        while ((size_t(1) << position_bits) < _table.size())
+        {
+            ++position_bits;
+        }
+
+        size_t shift = position_bits > BUILD_PARTITION_BITS ? position_bits - BUILD_PARTITION_BITS : 0;
+        std::vector<size_t> offsets((_table.size() >> shift) + 1, 0);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            ++offsets[((hashes[i] & _table.mask()) >> shift) + 1];
+        }
+
+        for (size_t part = 1; part < offsets.size(); ++part)
+        {
+            offsets[part] += offsets[part - 1];
+        }
+
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            order[offsets[(hashes[i] & _table.mask()) >> shift]++] = i;
+        }
+
+        // Ключи теперь читаются вразброс, поэтому запрашиваются заранее
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (i + BATCH_SIZE < count)
+            {
+                prefetch(&*(first + order[i + BATCH_SIZE]));
+            }
+            _add_hashed(first[order[i]], hashes[order[i]], step_hashes[order[i]]);
+        }
+    }
+
+    bool _is_migrating() const
+    {
+        return _old_table.size() != 0;
+    }
+
+    // Переносит следующие MIGRATION_STEP ячеек старой таблицы, обходя её
+    // назад от migration_start(). При двойном хешировании перенесённые ячейки
+    // помечаются удалёнными, чтобы не обрывать цепочки ещё не перенесённых ключей
+    void _migrate_step()
+    {
+        if (!_is_migrating())
+        {
+            return;
+        }
+
+        auto timer = _counters.start_timer();
+
+        size_t end = std::min(_migrate_pos + MIGRATION_STEP, _old_table.size());
+        for (; _migrate_pos < end; ++_migrate_pos)
+        {
+            size_t pos = (_migrate_start - 1 - _migrate_pos) & _old_table.mask();
+            if (_old_table.occupied(pos))
+            {
+                if (_compacting_storage)
+                {
+                    _old_table.cells[pos].key = _storage.copy_from(_old_storage, _old_table.cells[pos].key);
+                }
+
+                size_t step_hash = 0;
+                size_t hash = _cell_hash(_old_table.cells[pos], step_hash);
+
+                _table.place(std::move(_old_table.cells[pos]), hash, step_hash);
+                _old_table.remove(pos);
+            }
+        }
+
+        if (_migrate_pos == _old_table.size())
+        {
+            _old_table.release();
+            _migrate_pos = 0;
+
+            if (_compacting_storage)
+            {
+                _old_storage = S();
+                _compacting_storage = false;
+            }
+        }
+
+        _counters.record_rehash_time(timer);
+    }
+
+    /*
+    Вызывается после удаления. Когда ключей меньше 1/8 размера, таблица сжимается
+    до заполнения не больше 1/4, чтобы рост при 3/4 не наступил сразу.
+    Когда удалённые ячейки занимают 1/4 таблицы, она перестраивается без них.
+    В blocking режиме хранилище ключей сжимается до перестройки, пока все ключи
+    в одной таблице. В incremental режиме сжатие идёт вместе с перестройкой:
+    перенос ячейки переписывает и её ключ, так что за операцию копируется
+    не больше MIGRATION_STEP ключей.
+    Во время переноса ничего не делается, чтобы не доделывать его разом.
+    */
+    void _compact_table()
+    {
+        if (_is_migrating())
+        {
+            return;
+        }
+
+        bool compact_storage = _storage.needs_compaction();
+        if (compact_storage && _mode == resize_mode::blocking)
+        {
+            _compact_storage();
+            compact_storage = false;
+        }
+
+        size_t new_size = _table.size();
+        while (new_size / 2 >= _min_size && _size * 4 <= new_size / 2)
+        {
+            new_size /= 2;
+        }
+
+        if (compact_storage || new_size < _table.size() || _table.deleted * 4 >= _table.size())
+        {
+            _rehash(new_size, compact_storage);
+        }
+    }
+
+    // Переписывает живые ключи в новое хранилище, выбрасывая удалённые
+    void _compact_storage()
+    {
+        S storage;
+
+        for (size_t pos = 0; pos < _table.size(); ++pos)
+        {
+            if (_table.occupied(pos))
+            {
+                _table.cells[pos].key = storage.copy_from(_storage, _table.cells[pos].key);
+            }
+        }
+
+        _storage = std::move(storage);
+    }
+
+    void _finish_migration()
+    {
+        while (_is_migrating())
+        {
+            _migrate_step();
+        }
+    }
+
+    void _rehash(size_t new_size, bool compact_storage = false)
+    {
+        _finish_migration();
+
+        auto timer = _counters.start_timer();
+        _counters.record_rehash();
+
+        _old_table = std::move(_table);
+        _table = table_data(new_size);
+
+        if (compact_storage)
+        {
+            _old_storage = std::move(_storage);
+            _storage = S();
+            _compacting_storage = true;
+        }
+        _migrate_start = _old_table.migration_start();
+
+        _counters.record_rehash_time(timer);
+
+        if (_mode == resize_mode::blocking)
+        {
+            _finish_migration();
+        }
+    }
+};
+
+/*
+Множество для нескольких потоков: ключи делятся по шардам по битам хеша,
+у каждого шарда своя таблица и свой std::shared_mutex. Читатели одного
+шарда не блокируют друг друга и используют contains, который не меняет
+таблицу. Писатели блокируют только свой шард. Хеш считается один раз
+и передаётся в таблицу шарда.
+
+Чтение без блокировок здесь не делается: ячейки с std::string
+нельзя читать, пока писатель их меняет.
+*/
+template<typename T, typename H = std::hash<T>, typename S = inline_key_storage<T>,
+         typename P = double_hashing>
+class concurrent_hash_table
+{
+public:
+    concurrent_hash_table(size_t shard_count, H hasher1, H hasher2)
+        : _shard_bits(_bits_for(shard_count))
+    {
+        for (size_t i = 0; i < (size_t(1) << _shard_bits); ++i)
+        {
+            _shards.emplace_back(new shard(hasher1, hasher2));
+        }
+    }
+
+    concurrent_hash_table(size_t shard_count, H hasher)
+        : _shard_bits(_bits_for(shard_count))
+    {
+        for (size_t i = 0; i < (size_t(1) << _shard_bits); ++i)
+        {
+            _shards.emplace_back(new shard(hasher));
+        }
+    }
+
+    concurrent_hash_table(const concurrent_hash_table& t) = delete;
+    concurrent_hash_table& operator=(const concurrent_hash_table& t) = delete;
+
+    template<typename K = T>
+    bool add_key(const K& key)
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+        shard& target = *_shards[_shard_of_hash(hash)];
+
+        std::unique_lock<std::shared_mutex> lock(target.mutex);
+        return target.table._add_hashed(key, hash, step_hash);
+    }
+
+    template<typename K = T>
+    bool delete_key(const K& key)
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+        shard& target = *_shards[_shard_of_hash(hash)];
+
+        std::unique_lock<std::shared_mutex> lock(target.mutex);
+        return target.table._delete_hashed(key, hash, step_hash);
+    }
+
+    template<typename K = T>
+    bool has_key(const K& key) const
+    {
+        size_t step_hash = 0;
+        size_t hash = _hash(key, step_hash);
+        const shard& target = *_shards[_shard_of_hash(hash)];
+
+        std::shared_lock<std::shared_mutex> lock(target.mutex);
+        return target.table._contains_hashed(key, hash, step_hash);
+    }
+
+private:
+    // Выравнивание по кеш-линии, чтобы мьютексы соседних шардов не делили линию
+    struct alignas(64) shard
+    {
+        shard(H hasher1, H hasher2)
+            : table(hasher1, hasher2)
+        { }
+
+        explicit shard(H hasher)
+            : table(hasher)
+        { }
+
+        mutable std::shared_mutex mutex;
+        hash_table<T, H, S, P> table;
+    };
+
+    size_t _shard_bits;
+    std::vector<std::unique_ptr<shard>> _shards;
+
+    // Хеш-функции у всех шардов одинаковые и не меняются, поэтому
+    // хешировать через таблицу первого шарда можно без блокировки
+    template<typename K>
+    size_t _hash(const K& key, size_t& step_hash) const
+    {
+        return _shards[0]->table._hash(key, step_hash);
+    }
+
+    static size_t _bits_for(size_t shard_count)
+    {
+        size_t bits = 0;
+        while ((size_t(1) << bits) < shard_count)
+        {
+            ++bits;
+        }
+        return bits;
+    }
+
+    // Биты шарда берутся после умножения на другую константу, чем для
+    // управляющих байтов, чтобы внутри шарда 7 бит хеша не выродились
+    size_t _shard_of_hash(size_t hash) const
+    {
+        if (_shard_bits == 0)
+        {
+            return 0;
+        }
+        return size_t((uint64_t(hash) * 0xC2B2AE3D27D4EB4Full) >> (64 - _shard_bits));
+    }
+};
+
+struct string_hasher
+{
+    string_hasher(size_t p = 101)
+        : _p(p)
+    { }
+
+    size_t operator()(std::string_view key) const
+    {
+        size_t hash = 1;
+        for (const char& a : key)
+        {
+            hash = hash * _p + a;
+        }
+
+        return hash;
+    }
+
+private:
+    size_t _p;
+};
+
+/*
+Хеш в духе wyhash: строка читается словами по 8 байт,
+которые перемешиваются 128-битным умножением.
+*/
+struct wy_string_hasher
+{
+    wy_string_hasher(uint64_t seed = 0)
+        : _seed(seed)
+    { }
+
+    size_t operator()(std::string_view key) const
+    {
+        return hash(key.data(), key.size());
+    }
+
+    size_t hash(const char* data, size_t length) const
+    {
+        const uint64_t p0 = 0xa0761d6478bd642full;
+        const uint64_t p1 = 0xe7037ed1a0b428dbull;
+
+        uint64_t seed = _seed ^ _mix(_seed ^ p0, p1);
+        uint64_t a = 0;
+        uint64_t b = 0;
+
+        if (length <= 16)
+        {
+            if (length >= 4)
+            {
+                size_t shift = (length >> 3) << 2;
+                a = (_read4(data) << 32) | _read4(data + shift);
+                b = (_read4(data + length - 4) << 32) | _read4(data + length - 4 - shift);
+            }
+            else if (length > 0)
+            {
+                a = (uint64_t(uint8_t(data[0])) << 16) |
+                    (uint64_t(uint8_t(data[length >> 1])) << 8) |
+                    uint64_t(uint8_t(data[length - 1]));
+            }
+        }
+        else
+        {
+            size_t rest = length;
+            const char* p = data;
+            while (rest > 16)
+            {
+                seed = _mix(_read8(p) ^ p1, _read8(p + 8) ^ seed);
+                p += 16;
+                rest -= 16;
+            }
+            a = _read8(p + rest - 16);
+            b = _read8(p + rest - 8);
+        }
+
+        a ^= p1;
+        b ^= seed;
+        _multiply(a, b);
+        return _mix(a ^ p0 ^ length, b ^ p1);
+    }
+
+private:
+    uint64_t _seed;
+
+    static uint64_t _read8(const char* p)
+    {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint64_t _read4(const char* p)
+    {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    // Полное 128-битное произведение: младшая половина в a, старшая в b
+    static void _multiply(uint64_t& a, uint64_t& b)
+    {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 product = (unsigned __int128)a * b;
+        a = uint64_t(product);
+        b = uint64_t(product >> 64);
+#else
+        uint64_t a_high = a >> 32, a_low = uint32_t(a);
+        uint64_t b_high = b >> 32, b_low = uint32_t(b);
+        uint64_t high = a_high * b_high, middle1 = a_high * b_low;
+        uint64_t middle2 = a_low * b_high, low = a_low * b_low;
+        uint64_t t = low + (middle1 << 32);
+        uint64_t carry = t < low;
+        uint64_t result_low = t + (middle2 << 32);
+        carry += result_low < t;
+        b = high + (middle1 >> 32) + (middle2 >> 32) + carry;
+        a = result_low;
+#endif
+    }
+
+    static uint64_t _mix(uint64_t a, uint64_t b)
+    {
+        _multiply(a, b);
+        return a ^ b;
+    }
+};
+
+// Перемешивание 64-битного ключа финализатором splitmix64
+struct packed_key_hasher
+{
+    size_t operator()(uint64_t key) const
+    {
+        key ^= key >> 30;
+        key *= 0xBF58476D1CE4E5B9ull;
+        key ^= key >> 27;
+        key *= 0x94D049BB133111EBull;
+        key ^= key >> 31;
+        return size_t(key);
+    }
+};
+
+/*
+Строка до PACKED_KEY_LENGTH строчных латинских букв упаковывается
+по 5 бит на символ в uint64_t и хранится прямо в ячейке отдельной
+целочисленной таблицы: поиск не ходит по указателям и не сравнивает
+строки. Более длинные строки и строки с другими символами
+уходят в общую таблицу строк.
+Упакованные ключи хешируются packed_key_hasher, а не переданными
+функциями, поэтому run() по условию задачи остаётся на hash_table
+с хешем Горнера и двойным хешированием.
+Ячейка целочисленной таблицы хранит только ключ: сравнить его
+не дороже, чем хеш, а при переносе хеш дёшево пересчитать.
+*/
+#define PACKED_KEY_LENGTH 12
+
+template<typename H, typename S = inline_key_storage<std::string>, typename P = double_hashing>
+class packed_string_set
+{
+public:
+    packed_string_set(H hasher1, H hasher2, resize_mode mode = resize_mode::blocking)
+        : _packed(packed_key_hasher(), mode), _strings(hasher1, hasher2, mode)
+    { }
+
+    explicit packed_string_set(H hasher, resize_mode mode = resize_mode::blocking)
+        : _packed(packed_key_hasher(), mode), _strings(hasher, mode)
+    { }
+
+    bool add_key(std::string_view key)
+    {
+        uint64_t packed = 0;
+        return pack(key, packed) ? _packed.add_key(packed) : _strings.add_key(key);
+    }
+
+    bool delete_key(std::string_view key)
+    {
+        uint64_t packed = 0;
+        return pack(key, packed) ? _packed.delete_key(packed) : _strings.delete_key(key);
+    }
+
+    bool has_key(std::string_view key)
+    {
+        uint64_t packed = 0;
+        return pack(key, packed) ? _packed.has_key(packed) : _strings.has_key(key);
+    }
+
+    size_t size() const
+    {
+        return _packed.size() + _strings.size();
+    }
+
+    template<typename F>
+    void for_each_key(F f) const
+    {
+        char buffer[PACKED_KEY_LENGTH];
+        _packed.for_each_key([&](uint64_t packed) { f(unpack(packed, buffer)); });
+        _strings.for_each_key(f);
+    }
+
+    // Символ кодируется числом от 1 до 26, поэтому строки разной длины
+    // не совпадают: старшие пустые разряды равны нулю
+    static bool pack(std::string_view key, uint64_t& packed)
+    {
+        if (key.size() > PACKED_KEY_LENGTH)
+        {
+            return false;
+        }
+
+        packed = 0;
+        for (char c : key)
+        {
+            unsigned code = unsigned(c - 'a');
+            if (code >= 26)
+            {
+                return false;
+            }
+            packed = packed << 5 | (code + 1);
+        }
+
+        return true;
+    }
+
+    static std::string_view unpack(uint64_t packed, char* buffer)
+    {
+        size_t length = 0;
+        for (uint64_t rest = packed; rest; rest >>= 5)
+        {
+            ++length;
+        }
+
+        for (size_t i = length; i-- > 0; packed >>= 5)
+        {
+            buffer[i] = char('a' + (packed & 31) - 1);
+        }
+
+        return std::string_view(buffer, length);
+    }
+
+private:
+    hash_table<uint64_t, packed_key_hasher, inline_key_storage<uint64_t, false>, P> _packed;
+    hash_table<std::string, H, S, P> _strings;
+};
+
+/*
+Неизменяемый образ множества строк в файле: заголовок, массив слотов
+с линейным пробированием и блоб со строками подряд. Слот хранит полный хеш,
+смещение строки от начала блоба и её длину, так что образ не зависит
+от адреса, по которому отображён. Загрузка отображает файл через mmap
+и проверяет только заголовок, без работы на каждый ключ.
+Числа записаны в порядке байтов машины, сохранившей образ.
+Хеш-функция при загрузке должна совпадать с той, что была при сохранении;
+заголовок хранит её отпечаток.
+*/
+const uint64_t image_magic = 0x3147414D49544553ull;
+const uint32_t image_empty_length = 0xFFFFFFFF;
+
+struct image_header
+{
+    uint64_t magic;
+    uint64_t fingerprint;
+    uint64_t slot_count;
+    uint64_t key_count;
+    uint64_t blob_size;
+};
+
+struct image_slot
+{
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t length;
+};
+
+template<typename H>
+class string_set_image
+{
+public:
+    explicit string_set_image(H hasher)
+        : _hasher(hasher), _header(nullptr), _slots(nullptr), _blob(nullptr),
+          _mapping(nullptr), _mapping_size(0)
+    { }
+
+    ~string_set_image()
+    {
+        _unmap();
+    }
+
+    string_set_image(const string_set_image& t) = delete;
+    string_set_image& operator=(const string_set_image& t) = delete;
+
+    // Set должен уметь size() и for_each_key; блоб ограничен 4 ГиБ
+    template<typename Set>
+    static bool save(const Set& set, const char* path, H hasher)
+    {
+        size_t slot_count = INITIAL_SIZE;
+        while (slot_count < set.size() * 2)
+        {
+            slot_count *= 2;
+        }
+
+        std::vector<image_slot> slots(slot_count, image_slot{ 0, 0, image_empty_length });
+        std::string blob;
+        bool fits = true;
+
+        set.for_each_key([&](std::string_view key)
+        {
+            if (blob.size() + key.size() >= image_empty_length)
+            {
+                fits = false;
+                return;
+            }
+
+            uint64_t hash = hasher(key);
+            size_t pos = hash & (slot_count - 1);
+            while (slots[pos].length != image_empty_length)
+            {
+                pos = (pos + 1) & (slot_count - 1);
+            }
+
+            slots[pos] = image_slot{ hash, uint32_t(blob.size()), uint32_t(key.size()) };
+            blob.append(key);
+        });
+
+        if (!fits)
+        {
+            return false;
+        }
+
+        image_header header = { image_magic, _fingerprint(hasher), slot_count, set.size(), blob.size() };
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(image_slot));
+        out.write(blob.data(), blob.size());
+        out.close();
+
+        return !out.fail();
+    }
+
+    bool load(const char* path)
+    {
+        _unmap();
+
+        if (!_map(path) || !_check_header())
+        {
+            _unmap();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool has_key(std::string_view key) const
+    {
+        if (!_header)
+        {
+            return false;
+        }
+
+        uint64_t hash = _hasher(key);
+        size_t mask = _header->slot_count - 1;
+        size_t pos = hash & mask;
+
+        // Ограничение числа шагов защищает от испорченного образа без пустых слотов
+        for (size_t i = 0; i <= mask; ++i)
+        {
+            const image_slot& slot = _slots[pos];
+            if (slot.length == image_empty_length)
+            {
+                return false;
+            }
+
+            if (slot.hash == hash && slot.length == key.size() &&
+                uint64_t(slot.offset) + slot.length <= _header->blob_size &&
+                std::memcmp(_blob + slot.offset, key.data(), key.size()) == 0)
+            {
+                return true;
+            }
+
+            pos = (pos + 1) & mask;
+        }
+
+        return false;
+    }
+
+    size_t size() const
+    {
+        return _header ? _header->key_count : 0;
+    }
+
+private:
+    H _hasher;
+
+    const image_header* _header;
+    const image_slot* _slots;
+    const char* _blob;
+
+    void* _mapping;
+    size_t _mapping_size;
+#ifndef HASH_TABLE_MMAP
+    std::unique_ptr<uint64_t[]> _buffer;
+#endif
+
+    static uint64_t _fingerprint(const H& hasher)
+    {
+        return hasher(std::string_view("string_set_image"));
+    }
+
+    bool _check_header()
+    {
+        if (_mapping_size < sizeof(image_header))
+        {
+            return false;
+        }
+
+        _header = static_cast<const image_header*>(_mapping);
+
+        uint64_t slot_count = _header->slot_count;
+        uint64_t slots_size = _mapping_size - sizeof(image_header);
+
+        if (_header->magic != image_magic || _header->fingerprint != _fingerprint(_hasher) ||
+            slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+            slot_count > slots_size / sizeof(image_slot) ||
+            _header->blob_size != slots_size - slot_count * sizeof(image_slot))
+        {
+            return false;
+        }
+
+        _slots = reinterpret_cast<const image_slot*>(_header + 1);
+        _blob = reinterpret_cast<const char*>(_slots + slot_count);
+        return true;
+    }
+
+#ifdef HASH_TABLE_MMAP
+    bool _map(const char* path)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+
+        _mapping = mapping;
+        _mapping_size = size_t(info.st_size);
+        return true;
+    }
+
+    void _unmap()
+    {
+        if (_mapping)
+        {
+            munmap(_mapping, _mapping_size);
+        }
+
+        _header = nullptr;
+        _mapping = nullptr;
+        _mapping_size = 0;
+    }
+#else
+    // Без mmap образ читается в буфер целиком, выровненный под uint64_t
+    bool _map(const char* path)
+    {
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+        {
+            return false;
+        }
+
+        size_t size = size_t(in.tellg());
+        _buffer.reset(new uint64_t[(size + 7) / 8]);
+        in.seekg(0);
+        in.read(reinterpret_cast<char*>(_buffer.get()), size);
+        if (!in)
+        {
+            return false;
+        }
+
+        _mapping = _buffer.get();
+        _mapping_size = size;
+        return true;
+    }
+
+    void _unmap()
+    {
+        _buffer.reset();
+        _header = nullptr;
+        _mapping = nullptr;
+        _mapping_size = 0;
+    }
+#endif
+};
+
+/*
+Читает весь поток команд одним буфером и выдаёт слова
+как std::string_view внутрь него, без копирования каждого слова.
+*/
+class command_reader
+{
+public:
+    explicit command_reader(std::istream& in)
+        : _pos(0)
+    {
+        char chunk[1 << 16];
+        while (in.read(chunk, sizeof(chunk)) || in.gcount() > 0)
+        {
+            _buffer.append(chunk, in.gcount());
+        }
+    }
+
+    bool next(char& op, std::string_view& word)
+    {
+        _skip_spaces();
+        if (_pos == _buffer.size())
+        {
+            return false;
+        }
+        op = _buffer[_pos++];
+
+        _skip_spaces();
+        size_t begin = _pos;
+        while (_pos < _buffer.size() && !std::isspace(static_cast<unsigned char>(_buffer[_pos])))
+        {
+            ++_pos;
+        }
+
+        word = std::string_view(_buffer).substr(begin, _pos - begin);
+        return !word.empty();
+    }
+
+private:
+    std::string _buffer;
+    size_t _pos;
+
+    void _skip_spaces()
+    {
+        while (_pos < _buffer.size() && std::isspace(static_cast<unsigned char>(_buffer[_pos])))
+        {
+            ++_pos;
+        }
+    }
+};
+
+void run(std::istream& in, std::ostream& out)
+{
+    hash_table<std::string, decltype(string_hasher())> set(string_hasher(101), string_hasher(103));
+
+    command_reader reader(in);
+    char op = '\0';
+    std::string_view word;
+
+    while (reader.next(op, word))
+    {
+        switch (op)
+        {
+        case '+':
+            out << (set.add_key(word) ? "OK" : "FAIL") << '\n';
+            break;
+        case '-':
+            out << (set.delete_key(word) ? "OK" : "FAIL") << '\n';
+            break;
+        case '?':
+            out << (set.has_key(word) ? "OK" : "FAIL") << '\n';
+            break;
+        }
+    }
+}
+
+#ifdef HASH_TABLE_BENCH
+/*
+Замер масштабирования concurrent_hash_table. Каждый поток выполняет
+BENCH_OPS случайных операций над BENCH_KEYS ключами, из них
+write_percent процентов записей (поровну добавлений и удалений),
+остальное поиск. Та же нагрузка гоняется на одном шарде, то есть
+на одной таблице под одним std::shared_mutex, для сравнения.
+Сборка: g++ -O2 -std=c++17 -pthread -DHASH_TABLE_BENCH
+*/
+#define BENCH_KEYS (1 << 20)
+#define BENCH_OPS (1 << 21)
+
+// Миллионы операций в секунду по всем потокам
+template<typename Set>
+double bench_throughput(Set& set, const std::vector<std::string>& keys, size_t threads, int write_percent)
+{
+    std::vector<std::thread> workers;
+    std::atomic<size_t> found(0);
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t]()
+        {
+            uint64_t state = 0x9E3779B97F4A7C15ull * (t + 1);
+            size_t hits = 0;
+
+            for (size_t i = 0; i < BENCH_OPS; ++i)
+            {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+
+                const std::string& key = keys[state % keys.size()];
+                if (int((state >> 32) % 100) < write_percent)
+                {
+                    if ((state >> 40) & 1)
+                    {
+                        set.add_key(key);
+                    }
+                    else
+                    {
+                        set.delete_key(key);
+                    }
+                }
+                else
+                {
+                    hits += set.has_key(key);
+                }
+            }
+
+            found += hits;
+        });
+    }
+
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return threads * BENCH_OPS / elapsed.count();
+}
+
+void run_concurrent_bench(std::ostream& out)
+{
+    // Половина ключей заранее в множестве, поэтому половина поисков успешна
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < BENCH_KEYS; ++i)
+    {
+        keys.push_back("key" + std::to_string(i * 2654435761u % BENCH_KEYS));
+    }
+
+    size_t max_threads = std::max<size_t>(4, 2 * std::thread::hardware_concurrency());
+    out.setf(std::ios::fixed);
+    out.precision(2);
+    out << "cores " << std::thread::hardware_concurrency() << ", Mops/s: 64 shards / 1 shard\n";
+
+    for (int write_percent : { 0, 10, 50 })
+    {
+        for (size_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            out << "writes " << write_percent << "%, threads " << threads << ":";
+
+            for (size_t shards : { 64, 1 })
+            {
+                concurrent_hash_table<std::string, wy_string_hasher> set(shards, wy_string_hasher(1));
+                for (size_t i = 0; i < keys.size(); i += 2)
+                {
+                    set.add_key(keys[i]);
+                }
+
+                out << ' ' << bench_throughput(set, keys, threads, write_percent);
+            }
+
+            out << '\n';
+        }
+    }
+}
+
+/*
+Качество хеш-функций на наборе слов из входа, по одному в строке.
+Таблица берётся такого же размера, как у hash_table после reserve,
+и заполняется по одной ячейке за шаг тем же двойным хешированием,
+без групп: группа из GROUP_WIDTH ячеек скрывает короткие цепочки.
+Для каждой хеш-функции печатаются доля пустых начальных ячеек и
+наибольшее число ключей с одной начальной ячейкой, средняя длина
+пробирования в ячейках и её распределение для успешного и
+неуспешного поиска, и число совпавших 64-битных хешей. Рядом
+печатаются значения для идеально случайного хеша.
+*/
+template<typename H>
+void report_hash_quality(const char* name, const std::vector<std::string>& words,
+                         const std::vector<std::string>& misses, H hasher1, H hasher2,
+                         bool single_hash, std::ostream& out)
+{
+    const size_t histogram_size = 8;
+
+    size_t capacity = INITIAL_SIZE;
+    while (words.size() * 4 > capacity * 3)
+    {
+        capacity *= 2;
+    }
+    size_t mask = capacity - 1;
+
+    auto hash_of = [&](const std::string& word, size_t& step_hash)
+    {
+        size_t hash = hasher1(word);
+        step_hash = single_hash ? (hash >> 32 | hash << 32) : hasher2(word);
+        return hash;
+    };
+
+    std::vector<uint32_t> home_count(capacity, 0);
+    std::vector<bool> used(capacity, false);
+    std::vector<size_t> hashes;
+    size_t hit_histogram[histogram_size] = {};
+    size_t hit_total = 0;
+
+    for (const std::string& word : words)
+    {
+        size_t step_hash = 0;
+        size_t hash = hash_of(word, step_hash);
+        hashes.push_back(hash);
+
+        size_t pos = hash & mask;
+        size_t step = (step_hash * 2 + 1) & mask;
+        ++home_count[pos];
+
+        size_t probes = 1;
+        for (; used[pos]; ++probes)
+        {
+            pos = (pos + step) & mask;
+        }
+        used[pos] = true;
+
+        hit_total += probes;
+        ++hit_histogram[std::min(probes, histogram_size) - 1];
+    }
+
+    size_t miss_histogram[histogram_size] = {};
+    size_t miss_total = 0;
+
+    for (const std::string& word : misses)
+    {
+        size_t step_hash = 0;
+        size_t pos = hash_of(word, step_hash) & mask;
+        size_t step = (step_hash * 2 + 1) & mask;
+
+        size_t probes = 1;
+        for (; used[pos]; ++probes)
+        {
+            pos = (pos + step) & mask;
+        }
+
+        miss_total += probes;
+        ++miss_histogram[std::min(probes, histogram_size) - 1];
+    }
+
+    std::sort(hashes.begin(), hashes.end());
+    size_t same_hash = hashes.size() - (std::unique(hashes.begin(), hashes.end()) - hashes.begin());
+
+    size_t empty_homes = std::count(home_count.begin(), home_count.end(), 0u);
+    uint32_t max_home = *std::max_element(home_count.begin(), home_count.end());
+
+    out << name << ": empty homes " << 100.0 * empty_homes / capacity << "%, max keys per home " << max_home
+        << ", equal hashes " << same_hash << '\n';
+
+    out << "  hit  avg " << double(hit_total) / words.size() << " slots:";
+    for (size_t count : hit_histogram)
+    {
+        out << ' ' << 100.0 * count / words.size();
+    }
+
+    out << "\n  miss avg " << double(miss_total) / misses.size() << " slots:";
+    for (size_t count : miss_histogram)
+    {
+        out << ' ' << 100.0 * count / misses.size();
+    }
+    out << '\n';
+}
+
+void run_hash_quality(std::istream& in, std::ostream& out)
+{
+    std::vector<std::string> words;
+    for (std::string word; in >> word; )
+    {
+        words.push_back(word);
+    }
+
+    std::vector<std::string> sorted = words;
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    // Отсутствующие ключи получаются приписыванием букв к словам набора
+    std::vector<std::string> misses;
+    for (const std::string& word : sorted)
+    {
+        std::string miss = word + "zq";
+        if (!std::binary_search(sorted.begin(), sorted.end(), miss))
+        {
+            misses.push_back(miss);
+        }
+    }
+
+    // Повторы выбрасываются, порядок вставки остаётся как во входе
+    std::vector<std::string> unique_words;
+    hash_table<std::string, wy_string_hasher> seen(wy_string_hasher(2));
+    for (const std::string& word : words)
+    {
+        if (seen.add_key(word))
+        {
+            unique_words.push_back(word);
+        }
+    }
+
+    size_t capacity = INITIAL_SIZE;
+    while (unique_words.size() * 4 > capacity * 3)
+    {
+        capacity *= 2;
+    }
+    double load = double(unique_words.size()) / capacity;
+
+    out.setf(std::ios::fixed);
+    out.precision(2);
+    out << unique_words.size() << " words, table " << capacity << ", load " << load << '\n';
+    out << "random: empty homes " << 100.0 * std::exp(-load) << "%, hit avg " << std::log(1 / (1 - load)) / load
+        << " slots, miss avg " << 1 / (1 - load) << " slots\n";
+    out << "slot histograms: % of lookups taking 1, 2, ... 7, 8+ slots\n";
+
+    report_hash_quality("horner", unique_words, misses, string_hasher(101), string_hasher(103), false, out);
+    report_hash_quality("wyhash", unique_words, misses, wy_string_hasher(1), wy_string_hasher(1), true, out);
+}
+
+/*
+Задержка отдельных add_key при загрузке LATENCY_KEYS ключей в таблицу
+от начального размера, в blocking и incremental режимах. Каждая вставка
+замеряется отдельно; печатаются медиана, p99, p999 и максимум.
+*/
+#define LATENCY_KEYS (1 << 22)
+
+void print_latency(std::ostream& out, const char* name, std::vector<uint64_t>& nanoseconds)
+{
+    std::sort(nanoseconds.begin(), nanoseconds.end());
+
+    auto percentile = [&](double fraction)
+    {
+        return nanoseconds[size_t(fraction * (nanoseconds.size() - 1))] * 1e-3;
+    };
+
+    out << name << ": p50 " << percentile(0.5) << " us, p99 " << percentile(0.99)
+        << " us, p999 " << percentile(0.999) << " us, max " << nanoseconds.back() * 1e-3 << " us\n";
+}
+
+void run_latency_bench(std::ostream& out)
+{
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < LATENCY_KEYS; ++i)
+    {
+        keys.push_back("key" + std::to_string(i * 2654435761u % LATENCY_KEYS));
+    }
+
+    out.setf(std::ios::fixed);
+    out.precision(2);
+    out << LATENCY_KEYS << " add_key from an empty table\n";
+
+    for (resize_mode mode : { resize_mode::blocking, resize_mode::incremental })
+    {
+        hash_table<std::string, wy_string_hasher> set(wy_string_hasher(1), mode);
+        std::vector<uint64_t> nanoseconds(keys.size());
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            set.add_key(keys[i]);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            nanoseconds[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        }
+
+        print_latency(out, mode == resize_mode::blocking ? "blocking" : "incremental", nanoseconds);
+    }
+}
+
+/*
+Удаления и вставки без роста множества: в таблице всё время CHURN_LIVE
+ключей, каждая пара операций удаляет самый старый ключ и добавляет новый.
+После каждого из CHURN_ROUNDS раундов по CHURN_PAIRS пар замеряется
+среднее время поиска CHURN_LIVE отсутствующих и CHURN_LIVE живых ключей.
+Если удалённые ячейки не убираются, поиск отсутствующих ключей
+от раунда к раунду дорожает.
+*/
+#define CHURN_LIVE 200000
+#define CHURN_ROUNDS 8
+#define CHURN_PAIRS (1 << 23)
+
+template<typename Set>
+double bench_lookups(Set& set, const char* prefix, size_t first, size_t count)
+{
+    std::string key;
+    size_t found = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = first; i < first + count; ++i)
+    {
+        key = prefix + std::to_string(i);
+        found += set.has_key(key);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    return found <= count ? elapsed.count() / count : 0;
+}
+
+void run_churn_bench(std::ostream& out)
+{
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << CHURN_LIVE << " live keys, " << CHURN_PAIRS << " delete+insert pairs per round, ns per lookup\n";
+
+    for (resize_mode mode : { resize_mode::blocking, resize_mode::incremental })
+    {
+        hash_table<std::string, wy_string_hasher> set(wy_string_hasher(1), mode);
+        std::string key;
+
+        size_t next = 0;
+        for (; next < CHURN_LIVE; ++next)
+        {
+            set.add_key("k" + std::to_string(next));
+        }
+
+        for (size_t round = 1; round <= CHURN_ROUNDS; ++round)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t pair = 0; pair < CHURN_PAIRS; ++pair, ++next)
+            {
+                key = "k" + std::to_string(next - CHURN_LIVE);
+                set.delete_key(key);
+                key = "k" + std::to_string(next);
+                set.add_key(key);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            out << (mode == resize_mode::blocking ? "blocking" : "incremental") << " round " << round
+                << ": " << 2.0 * CHURN_PAIRS * round / 1e6 << "M ops, churn " << elapsed.count() << " s, miss "
+                << bench_lookups(set, "m", 0, CHURN_LIVE) << ", hit "
+                << bench_lookups(set, "k", next - CHURN_LIVE, CHURN_LIVE) << ", size " << set.size() << '\n';
+        }
+    }
+}
+
+/*
+Стоимость одного шага пробирования. Занятость ячеек задаётся массивом
+на PROBE_LOAD долей, и поиск отсутствующих ключей идёт до первой пустой
+ячейки двумя способами: прежним (hash + i * step) % size с делением
+и маской с нечётным шагом из double_hashing_table::probe_step.
+Печатается время на шаг при таблицах в кеше и вне его.
+*/
+#define PROBE_LOAD 0.9
+#define PROBE_LOOKUPS (1 << 22)
+
+void run_probe_bench(std::ostream& out)
+{
+    out.setf(std::ios::fixed);
+    out.precision(2);
+    out << "load " << PROBE_LOAD << ", " << PROBE_LOOKUPS << " misses, ns per probe: modulo / mask\n";
+
+    for (size_t size : { size_t(1) << 14, size_t(1) << 24 })
+    {
+        double_hashing_table<size_t> table(size);
+        std::vector<bool> used(size, false);
+
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+        auto next_random = [&state]()
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        };
+
+        for (size_t i = 0; i < size_t(size * PROBE_LOAD); ++i)
+        {
+            size_t pos = next_random() & table.mask();
+            while (used[pos])
+            {
+                pos = (pos + 1) & table.mask();
+            }
+            used[pos] = true;
+        }
+
+        std::vector<size_t> hashes(PROBE_LOOKUPS);
+        for (size_t& hash : hashes)
+        {
+            hash = next_random();
+        }
+
+        // Размер берётся из переменной, чтобы компилятор не заменил деление маской
+        volatile size_t runtime_size = size;
+        size_t modulo_size = runtime_size;
+
+        size_t modulo_probes = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t hash : hashes)
+        {
+            size_t step_hash = (hash >> 32 | hash << 32) % modulo_size;
+            step_hash = step_hash ? step_hash : 1;
+
+            // Чётный шаг не обходит всю таблицу, поэтому шагов не больше размера
+            for (size_t i = 0; i < modulo_size; ++i)
+            {
+                ++modulo_probes;
+                if (!used[(hash + i * step_hash) % modulo_size])
+                {
+                    break;
+                }
+            }
+        }
+        std::chrono::duration<double, std::nano> modulo_time = std::chrono::steady_clock::now() - start;
+
+        size_t mask_probes = 0;
+        start = std::chrono::steady_clock::now();
+        for (size_t hash : hashes)
+        {
+            size_t step = table.probe_step(hash >> 32 | hash << 32);
+            size_t pos = hash & table.mask();
+
+            for (++mask_probes; used[pos]; ++mask_probes)
+            {
+                pos = (pos + step) & table.mask();
+            }
+        }
+        std::chrono::duration<double, std::nano> mask_time = std::chrono::steady_clock::now() - start;
+
+        out << "table " << size << ": " << modulo_time.count() / modulo_probes << " / "
+            << mask_time.count() / mask_probes << " (" << double(modulo_probes) / PROBE_LOOKUPS << " / "
+            << double(mask_probes) / PROBE_LOOKUPS << " probes per miss)\n";
+    }
+}
+
+/*
+Сравнение политик пробирования на одной таблице строк: вставка
+POLICY_KEYS ключей, поиск присутствующих и отсутствующих, затем
+POLICY_PAIRS пар удаление+вставка и снова поиск. Для двойного
+хеширования после удалений остаются удалённые ячейки, а Robin Hood
+сдвигает цепочки. Печатается время в наносекундах на операцию.
+*/
+#define POLICY_KEYS (1 << 20)
+#define POLICY_PAIRS (1 << 22)
+
+template<typename P>
+void bench_policy(std::ostream& out, const char* name)
+{
+    hash_table<std::string, wy_string_hasher, inline_key_storage<std::string>, P> set(wy_string_hasher(1));
+    std::string key;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < POLICY_KEYS; ++i)
+    {
+        key = "k" + std::to_string(i);
+        set.add_key(key);
+    }
+    std::chrono::duration<double, std::nano> insert_time = std::chrono::steady_clock::now() - start;
+
+    out << name << ": insert " << insert_time.count() / POLICY_KEYS
+        << ", hit " << bench_lookups(set, "k", 0, POLICY_KEYS)
+        << ", miss " << bench_lookups(set, "m", 0, POLICY_KEYS);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < POLICY_PAIRS; ++i)
+    {
+        key = "k" + std::to_string(i);
+        set.delete_key(key);
+        key = "k" + std::to_string(i + POLICY_KEYS);
+        set.add_key(key);
+    }
+    std::chrono::duration<double, std::nano> churn_time = std::chrono::steady_clock::now() - start;
+
+    out << "; churn " << churn_time.count() / (2 * POLICY_PAIRS)
+        << ", hit " << bench_lookups(set, "k", POLICY_PAIRS, POLICY_KEYS)
+        << ", miss " << bench_lookups(set, "m", 0, POLICY_KEYS) << '\n';
+}
+
+void run_policy_bench(std::ostream& out)
+{
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << POLICY_KEYS << " keys, " << POLICY_PAIRS << " delete+insert pairs, ns per operation\n";
+
+    bench_policy<double_hashing>(out, "double hashing");
+    bench_policy<robin_hood_probing>(out, "robin hood");
+}
+
+/*
+Пакетные add_keys и has_keys против циклов add_key и has_key на таблице
+из BATCH_BENCH_KEYS ключей: около 400 МиБ ячеек, что намного больше
+кеша последнего уровня. Ключи запросов идут в случайном порядке,
+половина из них есть в таблице.
+*/
+#define BATCH_BENCH_KEYS (1 << 22)
+
+void run_batch_bench(std::ostream& out)
+{
+    std::vector<std::string> keys;
+    std::vector<std::string> queries;
+    for (size_t i = 0; i < BATCH_BENCH_KEYS; ++i)
+    {
+        keys.push_back("key" + std::to_string(i * 2654435761u % BATCH_BENCH_KEYS));
+        queries.push_back("key" + std::to_string((i * 40503u) % BATCH_BENCH_KEYS * 2));
+    }
+
+    auto milliseconds_since = [](std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << BATCH_BENCH_KEYS << " keys, ms: one by one / batched\n";
+
+    std::vector<bool> single_found;
+    double single_add = 0;
+    double single_has = 0;
+    {
+        hash_table<std::string, wy_string_hasher> set(wy_string_hasher(1));
+
+        auto start = std::chrono::steady_clock::now();
+        for (const std::string& key : keys)
+        {
+            set.add_key(key);
+        }
+        single_add = milliseconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        for (const std::string& key : queries)
+        {
+            single_found.push_back(set.has_key(key));
+        }
+        single_has = milliseconds_since(start);
+    }
+
+    std::vector<bool> batch_found;
+    double batch_add = 0;
+    double batch_has = 0;
+    {
+        hash_table<std::string, wy_string_hasher> set(wy_string_hasher(1));
+
+        auto start = std::chrono::steady_clock::now();
+        set.add_keys(keys.begin(), keys.end());
+        batch_add = milliseconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        set.has_keys(queries.begin(), queries.end(), batch_found);
+        batch_has = milliseconds_since(start);
+    }
+
+    out << "add: " << single_add << " / " << batch_add << '\n';
+    out << "has: " << single_has << " / " << batch_has
+        << (single_found == batch_found ? "" : " (results differ)") << '\n';
+}
+
+/*
+Построение таблицы из BUILD_BENCH_KEYS разных слов тремя способами:
+циклом add_key, циклом add_key после reserve и конструктором
+из диапазона. Печатается время в миллисекундах.
+*/
+#define BUILD_BENCH_KEYS 10000000
+
+void run_build_bench(std::ostream& out)
+{
+    std::vector<std::string> words;
+    words.reserve(BUILD_BENCH_KEYS);
+    for (size_t i = 0; i < BUILD_BENCH_KEYS; ++i)
+    {
+        words.push_back("w" + std::to_string(i * 2654435761u % BUILD_BENCH_KEYS));
+    }
+
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << BUILD_BENCH_KEYS << " words, ms\n";
+
+    {
+        auto start = std::chrono::steady_clock::now();
+        hash_table<std::string, wy_string_hasher> set(wy_string_hasher(1));
+        for (const std::string& word : words)
+        {
+            set.add_key(word);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        out << "add_key: " << elapsed.count() << " (size " << set.size() << ")\n";
+    }
+
+    {
+        auto start = std::chrono::steady_clock::now();
+        hash_table<std::string, wy_string_hasher> set(wy_string_hasher(1));
+        set.reserve(words.size());
+        for (const std::string& word : words)
+        {
+            set.add_key(word);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        out << "reserve + add_key: " << elapsed.count() << " (size " << set.size() << ")\n";
+    }
+
+    {
+        auto start = std::chrono::steady_clock::now();
+        hash_table<std::string, wy_string_hasher> set(words.begin(), words.end(), wy_string_hasher(1));
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+        out << "bulk build: " << elapsed.count() << " (size " << set.size() << ")\n";
+    }
+}
+
+/*
+Первый аргумент выбирает замер:
+concurrent (по умолчанию) — масштабирование concurrent_hash_table;
+quality — качество хеш-функций на словах из стандартного ввода;
+latency — задержки вставки в blocking и incremental режимах;
+churn — поиск при долгих удалениях и вставках;
+probe — стоимость шага пробирования с делением и с маской;
+batch — пакетные операции на таблице больше кеша;
+policy — двойное хеширование против Robin Hood;
+build — построение из диапазона против вставок по одному.
+*/
+int main(int argc, char** argv)
+{
+    std::string bench = argc > 1 ? argv[1] : "concurrent";
+
+    if (bench == "quality")
+    {
+        run_hash_quality(std::cin, std::cout);
+    }
+    else if (bench == "latency")
+    {
+        run_latency_bench(std::cout);
+    }
+    else if (bench == "churn")
+    {
+        run_churn_bench(std::cout);
+    }
+    else if (bench == "probe")
+    {
+        run_probe_bench(std::cout);
+    }
+    else if (bench == "batch")
+    {
+        run_batch_bench(std::cout);
+    }
+    else if (bench == "policy")
+    {
+        run_policy_bench(std::cout);
+    }
+    else if (bench == "build")
+    {
+        run_build_bench(std::cout);
+    }
+    else
+    {
+        run_concurrent_bench(std::cout);
+    }
+
+    return 0;
+}
+#else
 int main()
 {
     return run(std::cin, std::cout), 0;
 }
+#endif
\ No newline at end of file
@@ -9,51 +9,408 @@ B-дерево должно быть реализовано в виде шабл
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <thread>
+#include <type_traits>
 
-template <typename T, typename Compare = std::less<T>>
+#if defined(BTREE_TEST) || defined(BTREE_BENCH)
+#include <chrono>
+#include <random>
+#include <set>
+#include <string>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BTREE_SSE2
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#define BTREE_AVX2
+#endif
+
+// Окно, в котором 32-битные ключи досчитываются векторным сравнением
+#define SIMD_SEARCH_WINDOW 16
+
+// Предельный размер слэба в пуле узлов
+#define POOL_SLAB_BYTES (1 << 20)
+
+inline unsigned popCount(unsigned mask)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(mask);
+#else
+    unsigned count = 0;
+    for (; mask; mask &= mask - 1)
+        count++;
+    return count;
+#endif
+}
+
+#ifdef BTREE_SSE2
+// Число ключей меньше key. Беззнаковые ключи сравниваются как знаковые
+// после инверсии старшего бита
+template <typename T>
+size_t simdCountLess(const T *keys, size_t size, T key)
+{
+    const uint32_t flip = std::is_signed<T>::value ? 0 : 0x80000000u;
+    size_t count = 0;
+    size_t i = 0;
+
+#ifdef BTREE_AVX2
+    __m256i needle8 = _mm256_set1_epi32(int32_t(uint32_t(key) ^ flip));
+    __m256i flip8 = _mm256_set1_epi32(int32_t(flip));
+    for (; i + 8 <= size; i += 8)
+    {
+        __m256i block = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i)), flip8);
+        count += popCount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(needle8, block))));
+    }
+#endif
+    
+    __m128i needle = _mm_set1_epi32(int32_t(uint32_t(key) ^ flip));
+    __m128i flip4 = _mm_set1_epi32(int32_t(flip));
+    for (; i + 4 <= size; i += 4)
+    {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), flip4);
+        count += popCount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(block, needle))));
+    }
+    
+    for (; i < size; i++)
+        count += keys[i] < key;
+    
+    return count;
+}
+#endif
+
+/*
+Поиск позиции в узле: lowerBound возвращает первый ключ не меньше key,
+upperBound первый ключ больше key. Для произвольного comp это обычный
+двоичный поиск.
+*/
+template <typename T, typename Compare, typename Enable = void>
+struct NodeSearch
+{
+    static size_t lowerBound(const T *keys, size_t size, const T &key, const Compare &comp)
+    {
+        return std::lower_bound(keys, keys + size, key, comp) - keys;
+    }
+    
+    static size_t upperBound(const T *keys, size_t size, const T &key, const Compare &comp)
+    {
+        return std::upper_bound(keys, keys + size, key, comp) - keys;
+    }
+};
+
+/*
+Числа со std::less сравниваются дёшево, поэтому двоичный поиск идёт
+без ветвлений: шаг выбирается условной пересылкой, а не переходом.
+Для 32-битных ключей он останавливается на окне SIMD_SEARCH_WINDOW
+ключей, а позиция в окне равна числу единиц в маске векторного сравнения.
+*/
+template <typename T>
+struct NodeSearch<T, std::less<T>, typename std::enable_if<std::is_arithmetic<T>::value>::type>
+{
+#ifdef BTREE_SSE2
+    static const bool vectorized = std::is_integral<T>::value && sizeof(T) == 4;
+#else
+    static const bool vectorized = false;
+#endif
+    
+    static size_t lowerBound(const T *keys, size_t size, const T &key, const std::less<T>&)
+    {
+        const size_t window = vectorized ? SIMD_SEARCH_WINDOW : 1;
+        
+        const T *base = keys;
+        while (size > window)
+        {
+            size_t half = size / 2;
+            base = base[half] < key ? base + half : base;
+            size -= half;
+        }
+        
+        // Все ключи до base меньше key, все после окна не меньше
+#ifdef BTREE_SSE2
+        if constexpr (vectorized)
+            return base - keys + simdCountLess(base, size, key);
+#endif
+        return base - keys + (size != 0 && *base < key);
+    }
+    
+    static size_t upperBound(const T *keys, size_t size, const T &key, const std::less<T>&)
+    {
+        if (size == 0)
+            return 0;
+        
+        const T *base = keys;
+        while (size > 1)
+        {
+            size_t half = size / 2;
+            base = key < base[half] ? base : base + half;
+            size -= half;
+        }
+        return base - keys + !(key < *base);
+    }
+};
+
+/*
+Пул блоков одного размера. Блоки нарезаются подряд из слэбов, размер
+слэба удваивается до POOL_SLAB_BYTES. Освобождённый блок уходит в
+список свободных и хранит в себе указатель на следующий, так что
+выделение и освобождение стоят пары присваиваний. Память возвращается
+только целыми слэбами в Release.
+*/
+class NodePool
+{
+public:
+    NodePool(size_t blockBytes, size_t alignment)
+    : blockBytes((blockBytes + alignment - 1) / alignment * alignment),
+      slabBlocks(firstSlabBlocks), used(slabBlocks), freeList(nullptr)
+    {
+    }
+    
+    ~NodePool()
+    {
+        Release();
+    }
+    
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+    
+    void* Allocate()
+    {
+        if (freeList)
+        {
+            void *block = freeList;
+            freeList = *static_cast<void**>(block);
+            return block;
+        }
+        
+        if (used == slabBlocks)
+        {
+            if (!slabs.empty() && slabBlocks * blockBytes * 2 <= POOL_SLAB_BYTES)
+                slabBlocks *= 2;
+            
+            slabs.push_back(static_cast<char*>(::operator new(slabBlocks * blockBytes)));
+            used = 0;
+        }
+        
+        return slabs.back() + blockBytes * used++;
+    }
+    
+    void Free(void *block)
+    {
+        *static_cast<void**>(block) = freeList;
+        freeList = block;
+    }
+    
+    // Отдаёт все слэбы разом, блоки пула после этого недействительны
+    void Release()
+    {
+        for (char *slab : slabs)
+            ::operator delete(slab);
+        
+        slabs.clear();
+        slabBlocks = firstSlabBlocks;
+        used = slabBlocks;
+        freeList = nullptr;
+    }
+    
+private:
+    static const size_t firstSlabBlocks = 8;
+    
+    size_t blockBytes;
+    size_t slabBlocks;
+    size_t used;
+    void *freeList;
+    std::vector<char*> slabs;
+};
+
+/*
+Classic: ключи лежат во всех узлах, каждый ключ хранится один раз.
+BPlus: все ключи лежат в листьях, связанных в список по возрастанию,
+а внутренние узлы хранят только разделители: ключи левого поддерева
+не больше разделителя, правого не меньше. Упорядоченный обход
+тогда идёт по листьям подряд, не возвращаясь во внутренние узлы.
+*/
+enum class BTreeLayout
+{
+    Classic,
+    BPlus
+};
+
+template <typename T, typename Compare = std::less<T>, BTreeLayout Layout = BTreeLayout::Classic>
 class BTree
 {
+    static const bool linkedLeaves = Layout == BTreeLayout::BPlus;
+    
 public:
+    /*
+    Узел занимает один блок памяти: заголовок, сразу за ним 2t-1 ключей
+    и, у внутреннего узла, 2t указателей на детей. Спуск к ключу стоит
+    одной загрузки узла, а не узла и двух буферов векторов.
+    Все 2t-1 ключей сконструированы всегда, действительны первые size.
+    next связывает листья в режиме BPlus. Листья и внутренние узлы
+    берутся из двух пулов дерева, по одному на размер блока.
+    */
     struct Node
     {
-        Node(bool leaf)
-        : leaf(leaf)
+        Node(bool leaf, T *keys, Node **children)
+        : leaf(leaf), size(0), keys(keys), children(children), next(nullptr)
+        {
+        }
+        
+        bool leaf;
+        size_t size;
+        T *keys;
+        Node **children;
+        Node *next;
+    };
+    
+    /*
+    Прямой итератор по ключам в порядке возрастания. Путь от корня
+    хранится явным стеком: у верхнего узла index указывает на текущий
+    ключ, у предков на ключ, к которому вернёмся после поддерева
+    children[index]. Каждый узел входит в стек один раз за обход.
+    В режиме BPlus в стеке только текущий лист, а следующий берётся по next.
+    Любое изменение дерева делает итераторы недействительными.
+    */
+    class Iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+        
+        Iterator()
+        {
+        }
+        
+        reference operator*() const
         {
+            return path.back().node->keys[path.back().index];
         }
         
-        ~Node()
+        pointer operator->() const
         {
-            for (Node* child: children)
+            return &**this;
+        }
+        
+        Iterator& operator++()
+        {
+            Step &top = path.back();
+            
+            if (!top.node->leaf)
             {
-                delete child;
+                top.index++;
+                descendLeftmost(top.node->children[top.index]);
+                return *this;
             }
+            
+            top.index++;
+            
+            if constexpr (linkedLeaves)
+            {
+                if (top.index == top.node->size)
+                {
+                    top.node = top.node->next;
+                    top.index = 0;
+                    if (!top.node)
+                        path.pop_back();
+                }
+            }
+            else
+            {
+                skipFinished();
+            }
+            return *this;
         }
         
-        bool leaf;
-        std::vector<T> keys;
-        std::vector<Node*> children;
+        Iterator operator++(int)
+        {
+            Iterator old = *this;
+            ++*this;
+            return old;
+        }
+        
+        bool operator==(const Iterator &other) const
+        {
+            if (path.empty() || other.path.empty())
+                return path.empty() == other.path.empty();
+            
+            return path.back().node == other.path.back().node &&
+                   path.back().index == other.path.back().index;
+        }
+        
+        bool operator!=(const Iterator &other) const
+        {
+            return !(*this == other);
+        }
+    
+    private:
+        friend class BTree;
+        
+        struct Step
+        {
+            const Node *node;
+            size_t index;
+        };
+        
+        std::vector<Step> path;
+        
+        void descendLeftmost(const Node *node)
+        {
+            path.push_back({node, 0});
+            
+            while (!node->leaf)
+            {
+                node = node->children[0];
+                path.push_back({node, 0});
+            }
+        }
+        
+        // Снимает узлы, ключи которых уже пройдены
+        void skipFinished()
+        {
+            while (!path.empty() && path.back().index == path.back().node->size)
+                path.pop_back();
+        }
     };
     
     BTree(size_t minDegree, Compare comp = Compare())
-    : t(minDegree), root(nullptr), comp(comp)
+    : t(minDegree), root(nullptr), comp(comp),
+      keysOffset(alignUp(sizeof(Node), alignof(T))),
+      childrenOffset(alignUp(keysOffset + (2*t - 1) * sizeof(T), alignof(Node*))),
+      leafPool(nodeBytes(true), nodeAlignment),
+      innerPool(nodeBytes(false), nodeAlignment)
     {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned keys are not supported");
     }
     
     ~BTree()
     {
-        if (root)
-            delete root;
+        destroyTree();
     }
     
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
+    
     void Insert(const T &key)
     {
         if (!root)
-            root = new Node(true);
+            root = createNode(true);
         
         if (isNodeFull(root))
         {
-            Node *newRoot = new Node(false);
-            newRoot->children.push_back(root);
+            Node *newRoot = createNode(false);
+            newRoot->children[0] = root;
             root = newRoot;
             splitChild(root, 0);
         }
@@ -61,11 +418,191 @@ public:
         insertNonFull(root, key);
     }
     
+    /*
+    Удаляет одно вхождение key. Спуск однопроходный, как при вставке:
+    прежде чем перейти в ребёнка с t-1 ключами, ему отдаётся ключ соседа
+    или он сливается с соседом, поэтому удаление из листа никогда
+    не требует подниматься обратно. Опустевший корень заменяется ребёнком.
+    */
+    bool Erase(const T &key)
+    {
+        if (!root)
+            return false;
+        
+        bool erased = linkedLeaves ? eraseFromLeaves(root, key) : eraseFrom(root, key);
+        
+        if (root->size == 0)
+        {
+            Node *oldRoot = root;
+            root = root->leaf ? nullptr : root->children[0];
+            freeNode(oldRoot);
+        }
+        
+        return erased;
+    }
+    
+    // Указатель на хранимый ключ, равный key, или nullptr
+    const T* Find(const T &key) const
+    {
+        if constexpr (linkedLeaves)
+            return findInLeaves(key);
+        
+        const Node *node = root;
+        
+        while (node)
+        {
+            size_t pos = Search::lowerBound(node->keys, node->size, key, comp);
+            if (pos < node->size && !comp(key, node->keys[pos]))
+                return node->keys + pos;
+            
+            node = node->leaf ? nullptr : node->children[pos];
+        }
+        
+        return nullptr;
+    }
+    
+    bool Contains(const T &key) const
+    {
+        return Find(key) != nullptr;
+    }
+    
+    Iterator begin() const
+    {
+        Iterator it;
+        if (!root || root->size == 0)
+            return it;
+        
+        if constexpr (linkedLeaves)
+        {
+            const Node *node = root;
+            while (!node->leaf)
+                node = node->children[0];
+            it.path.push_back({node, 0});
+        }
+        else
+        {
+            it.descendLeftmost(root);
+        }
+        return it;
+    }
+    
+    Iterator end() const
+    {
+        return Iterator();
+    }
+    
+    // Первый ключ не меньше key; ключи из [a, b) дают LowerBound(a) до LowerBound(b)
+    Iterator LowerBound(const T &key) const
+    {
+        return seek(key, false);
+    }
+    
+    // Первый ключ больше key
+    Iterator UpperBound(const T &key) const
+    {
+        return seek(key, true);
+    }
+    
+    /*
+    Строит дерево заново из отсортированного диапазона с произвольным
+    доступом за O(N): листья заполняются слева направо примерно на
+    fillFactor от 2t-1 ключей, между соседними листьями остаётся ключ-
+    разделитель (в режиме BPlus это копия первого ключа правого листа),
+    и из узлов с разделителями так же собирается каждый следующий
+    уровень. Число узлов уровня выбирается так, чтобы все они получили
+    от t-1 до 2t-1 ключей. Границы листьев вычисляются заранее,
+    поэтому при threads > 1 листья строятся параллельно. Пул не
+    потокобезопасен, поэтому узлы листьев выделяются заранее.
+    */
+    template <typename It>
+    void BulkLoad(It first, It last, double fillFactor = 1.0, size_t threads = 1)
+    {
+        destroyTree();
+        
+        size_t count = last - first;
+        if (count == 0)
+            return;
+        
+        // В классическом дереве за каждым листом, кроме последнего, идёт разделитель
+        const size_t separatorItems = linkedLeaves ? 0 : 1;
+        
+        size_t leafKeys = std::max(t - 1, std::min(2*t - 1, size_t(fillFactor * (2*t - 1))));
+        size_t leafItems = count + separatorItems;
+        size_t leafCount = levelWidth(leafItems, leafKeys + separatorItems);
+        
+        std::vector<Node*> nodes(leafCount);
+        std::vector<T> separators(leafCount - 1);
+        
+        for (Node *&leaf : nodes)
+            leaf = createNode(true);
+        
+        auto buildLeaves = [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                size_t offset = levelOffset(leafItems, leafCount, i);
+                size_t size = levelOffset(leafItems, leafCount, i + 1) - offset - separatorItems;
+                
+                std::copy(first + offset, first + offset + size, nodes[i]->keys);
+                nodes[i]->size = size;
+                
+                if (i + 1 < leafCount)
+                    separators[i] = first[offset + size];
+            }
+        };
+        
+        threads = std::max<size_t>(1, std::min(threads, leafCount));
+        
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threads; i++)
+            workers.emplace_back(buildLeaves, leafCount * i / threads, leafCount * (i + 1) / threads);
+        buildLeaves(0, leafCount / threads);
+        
+        for (std::thread &worker : workers)
+            worker.join();
+        
+        if constexpr (linkedLeaves)
+        {
+            for (size_t i = 0; i + 1 < leafCount; i++)
+                nodes[i]->next = nodes[i + 1];
+        }
+        
+        size_t childKeys = std::max(t, std::min(2*t, size_t(fillFactor * 2*t)));
+        
+        while (nodes.size() > 1)
+        {
+            size_t width = levelWidth(nodes.size(), childKeys);
+            
+            std::vector<Node*> parents(width);
+            std::vector<T> parentSeparators(width - 1);
+            
+            for (size_t i = 0; i < width; i++)
+            {
+                size_t offset = levelOffset(nodes.size(), width, i);
+                size_t size = levelOffset(nodes.size(), width, i + 1) - offset;
+                
+                Node *parent = createNode(false);
+                std::copy(nodes.begin() + offset, nodes.begin() + offset + size, parent->children);
+                std::move(separators.begin() + offset, separators.begin() + offset + size - 1, parent->keys);
+                parent->size = size - 1;
+                parents[i] = parent;
+                
+                if (i + 1 < width)
+                    parentSeparators[i] = std::move(separators[offset + size - 1]);
+            }
+            
+            nodes.swap(parents);
+            separators.swap(parentSeparators);
+        }
+        
+        root = nodes[0];
+    }
+    
     template <typename KeyVisitor, typename LevelEndVisitor>
     void Traverse(KeyVisitor visitKey, LevelEndVisitor visitLevelEnd) {
         if (!root)
             return;
-            
+        
         std::queue<Node*> queue;
         std::queue<Node*> nextLevel;
         
@@ -75,12 +612,14 @@ public:
             Node* node = queue.front();
             queue.pop();
             
-            for (const T& key : node->keys) {
-                visitKey(key);
+            for (size_t i = 0; i < node->size; i++) {
+                visitKey(node->keys[i]);
             }
             
-            for (Node* child : node->children) {
-                nextLevel.push(child);
+            if (!node->leaf) {
+                for (size_t i = 0; i <= node->size; i++) {
+                    nextLevel.push(node->children[i]);
+                }
             }
             
             if (queue.empty() && !nextLevel.empty()) {
@@ -91,70 +630,820 @@ public:
     }
     
 private:
+    typedef NodeSearch<T, Compare> Search;
+    
+    size_t bound(const Node *node, const T &key, bool upper) const
+    {
+        return upper ? Search::upperBound(node->keys, node->size, key, comp)
+                     : Search::lowerBound(node->keys, node->size, key, comp);
+    }
+    
+    /*
+    Первый ключ не меньше key лежит в листе, куда ведёт lowerBound,
+    либо первым в следующем: все разделители на пути справа не меньше key
+    */
+    const T* findInLeaves(const T &key) const
+    {
+        const Node *node = root;
+        if (!node)
+            return nullptr;
+        
+        while (!node->leaf)
+            node = node->children[Search::lowerBound(node->keys, node->size, key, comp)];
+        
+        size_t pos = Search::lowerBound(node->keys, node->size, key, comp);
+        if (pos == node->size)
+        {
+            node = node->next;
+            pos = 0;
+        }
+        
+        if (node && !comp(key, node->keys[pos]))
+            return node->keys + pos;
+        return nullptr;
+    }
+    
+    /*
+    Уровень из items элементов (ключ или ребёнок вместе со следующим
+    разделителем) делится на узлы по целевой ширине target, но так,
+    чтобы на узел приходилось не меньше t элементов. Элементы делятся
+    поровну, первые узлы получают на один больше.
+    */
+    size_t levelWidth(size_t items, size_t target) const
+    {
+        size_t width = std::min((items + target - 1) / target, items / t);
+        return std::max<size_t>(1, width);
+    }
+    
+    static size_t levelOffset(size_t items, size_t width, size_t index)
+    {
+        return index * (items / width) + std::min(index, items % width);
+    }
+    
+    // Спускается до листа, запоминая в каждом узле позицию границы,
+    // и поднимается к первому предку, у которого справа ещё есть ключ
+    Iterator seek(const T &key, bool upper) const
+    {
+        Iterator it;
+        const Node *node = root;
+        
+        if constexpr (linkedLeaves)
+        {
+            if (!node)
+                return it;
+            
+            while (!node->leaf)
+                node = node->children[bound(node, key, upper)];
+            
+            size_t pos = bound(node, key, upper);
+            if (pos == node->size)
+            {
+                node = node->next;
+                pos = 0;
+            }
+            
+            if (node)
+                it.path.push_back({node, pos});
+            return it;
+        }
+        
+        while (node)
+        {
+            size_t pos = upper ? Search::upperBound(node->keys, node->size, key, comp)
+                               : Search::lowerBound(node->keys, node->size, key, comp);
+            it.path.push_back({node, pos});
+            node = node->leaf ? nullptr : node->children[pos];
+        }
+        
+        it.skipFinished();
+        return it;
+    }
+    
+    static size_t alignUp(size_t offset, size_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+    
+    // Лист не хранит массив детей, поэтому его блок короче
+    size_t nodeBytes(bool leaf) const
+    {
+        return leaf ? childrenOffset : childrenOffset + 2*t * sizeof(Node*);
+    }
+    
+    Node* createNode(bool leaf)
+    {
+        char *memory = static_cast<char*>(leaf ? leafPool.Allocate() : innerPool.Allocate());
+        
+        T *keys = reinterpret_cast<T*>(memory + keysOffset);
+        Node **children = leaf ? nullptr : reinterpret_cast<Node**>(memory + childrenOffset);
+        
+        for (size_t i = 0; i < 2*t - 1; i++)
+            new (keys + i) T();
+        
+        return new (memory) Node(leaf, keys, children);
+    }
+    
+    /*
+    Удаляет всё дерево. Узлы по одному не освобождаются: пулы отдают
+    слэбы целиком. Обходить дерево (явным стеком) нужно, только если
+    у ключей есть деструктор.
+    */
+    void destroyTree()
+    {
+        static_assert(std::is_trivially_destructible<Node>::value, "Node is released without its destructor");
+        
+        if constexpr (!std::is_trivially_destructible<T>::value)
+        {
+            std::vector<Node*> stack;
+            if (root)
+                stack.push_back(root);
+            
+            while (!stack.empty())
+            {
+                Node *node = stack.back();
+                stack.pop_back();
+                
+                if (!node->leaf)
+                    stack.insert(stack.end(), node->children, node->children + node->size + 1);
+                
+                for (size_t i = 0; i < 2*t - 1; i++)
+                    node->keys[i].~T();
+            }
+        }
+        
+        root = nullptr;
+        leafPool.Release();
+        innerPool.Release();
+    }
+    
+    // Возвращает в пул только сам узел, не трогая детей
+    void freeNode(Node *node)
+    {
+        for (size_t i = 0; i < 2*t - 1; i++)
+            node->keys[i].~T();
+        
+        NodePool &pool = node->leaf ? leafPool : innerPool;
+        node->~Node();
+        pool.Free(node);
+    }
+    
     bool isNodeFull(Node *node)
     {
-        return node->keys.size() == 2*t - 1;
+        return node->size == 2*t - 1;
     }
     
     void splitChild(Node *node, size_t index)
     {
         Node* y = node->children[index];
-        Node* z = new Node(y->leaf);
+        Node* z = createNode(y->leaf);
         
-        for (size_t j = 0; j < t - 1; j++)
-            z->keys.push_back(y->keys[j + t]);
-        
-        if (!y->leaf)
+        // Лист B+-дерева отдаёт t ключей целиком, наверх уходит копия первого из них
+        if (linkedLeaves && y->leaf)
         {
-            for (size_t j = 0; j < t; j++)
-                z->children.push_back(y->children[j + t]);
-            
-            y->children.erase(y->children.begin() + t, y->children.end());
+            std::move(y->keys + t - 1, y->keys + 2*t - 1, z->keys);
+            z->size = t;
+            z->next = y->next;
+            y->next = z;
+            y->keys[t - 1] = z->keys[0];
+        }
+        else
+        {
+            std::move(y->keys + t, y->keys + 2*t - 1, z->keys);
+            z->size = t - 1;
         }
         
-        node->children.insert(node->children.begin() + index + 1, z);
+        if (!y->leaf)
+            std::copy(y->children + t, y->children + 2*t, z->children);
         
-        node->keys.insert(node->keys.begin() + index, y->keys[t - 1]);
+        std::copy_backward(node->children + index + 1, node->children + node->size + 1,
+                           node->children + node->size + 2);
+        node->children[index + 1] = z;
         
-        y->keys.resize(t - 1);
+        std::move_backward(node->keys + index, node->keys + node->size, node->keys + node->size + 1);
+        node->keys[index] = std::move(y->keys[t - 1]);
+        node->size++;
+        
+        y->size = t - 1;
     }
     
     void insertNonFull(Node *node, const T &key)
     {
-        int pos = node->keys.size() - 1;
+        // Равные ключи остаются в порядке вставки: новый встаёт после них
+        size_t pos = Search::upperBound(node->keys, node->size, key, comp);
         
         if (node->leaf)
         {
-            node->keys.resize(node->keys.size() + 1);
-            while (pos >= 0 && comp(key, node->keys[pos]))
+            std::move_backward(node->keys + pos, node->keys + node->size, node->keys + node->size + 1);
+            node->keys[pos] = key;
+            node->size++;
+        }
+        else
+        {
+            if (isNodeFull(node->children[pos]))
             {
-                node->keys[pos + 1] = node->keys[pos];
-                pos--;
+                splitChild(node, pos);
+                // Равный разделителю ключ в B+-дереве идёт вправо, как и при выборе pos
+                if (linkedLeaves ? !comp(key, node->keys[pos]) : comp(node->keys[pos], key))
+                    pos++;
             }
-            node->keys[pos + 1] = key;
+            insertNonFull(node->children[pos], key);
         }
-        else
+    }
+    
+    bool eraseFrom(Node *node, const T &key)
+    {
+        while (true)
         {
-            while (pos >= 0 && comp(key, node->keys[pos]))
+            size_t pos = Search::lowerBound(node->keys, node->size, key, comp);
+            bool found = pos < node->size && !comp(key, node->keys[pos]);
+            
+            if (node->leaf)
             {
-                pos--;
+                if (!found)
+                    return false;
+                
+                std::move(node->keys + pos + 1, node->keys + node->size, node->keys + pos);
+                node->size--;
+                return true;
             }
             
-            if (isNodeFull(node->children[pos + 1]))
+            if (found)
             {
-                splitChild(node, pos + 1);
-                if (comp(node->keys[pos + 1], key))
-                    pos++;
+                Node *left = node->children[pos];
+                Node *right = node->children[pos + 1];
+                
+                if (left->size >= t)
+                {
+                    node->keys[pos] = removeMax(left);
+                    return true;
+                }
+                
+                if (right->size >= t)
+                {
+                    node->keys[pos] = removeMin(right);
+                    return true;
+                }
+                
+                // key опускается в середину слитого узла
+                mergeChildren(node, pos);
+                node = left;
+                continue;
             }
-            insertNonFull(node->children[pos + 1], key);
+            
+            node = node->children[fillChild(node, pos)];
+        }
+    }
+    
+    /*
+    Удаление в B+-дереве. Спуск идёт по lowerBound с той же подготовкой
+    детей, что и в классическом дереве. Первое вхождение key лежит в
+    найденном листе либо первым в следующем. Во втором случае, если
+    следующему листу не хватит ключей, ему отдаётся последний ключ
+    найденного листа, а разделитель между ними в их ближайшем общем
+    предке заменяется этим ключом.
+    */
+    bool eraseFromLeaves(Node *node, const T &key)
+    {
+        Node *ancestor = nullptr;
+        size_t separator = 0;
+        
+        while (!node->leaf)
+        {
+            size_t pos = fillChild(node, Search::lowerBound(node->keys, node->size, key, comp));
+            if (pos < node->size)
+            {
+                ancestor = node;
+                separator = pos;
+            }
+            node = node->children[pos];
+        }
+        
+        size_t pos = Search::lowerBound(node->keys, node->size, key, comp);
+        if (pos < node->size)
+        {
+            if (comp(key, node->keys[pos]))
+                return false;
+            
+            std::move(node->keys + pos + 1, node->keys + node->size, node->keys + pos);
+            node->size--;
+            return true;
+        }
+        
+        Node *next = node->next;
+        if (!next || comp(key, next->keys[0]))
+            return false;
+        
+        if (next->size >= t)
+        {
+            std::move(next->keys + 1, next->keys + next->size, next->keys);
+            next->size--;
+            return true;
+        }
+        
+        node->size--;
+        next->keys[0] = std::move(node->keys[node->size]);
+        ancestor->keys[separator] = next->keys[0];
+        return true;
+    }
+    
+    // Удаляют крайний ключ поддерева, в корне которого не меньше t ключей
+    T removeMax(Node *node)
+    {
+        while (!node->leaf)
+            node = node->children[fillChild(node, node->size)];
+        
+        node->size--;
+        return std::move(node->keys[node->size]);
+    }
+    
+    T removeMin(Node *node)
+    {
+        while (!node->leaf)
+            node = node->children[fillChild(node, 0)];
+        
+        T key = std::move(node->keys[0]);
+        std::move(node->keys + 1, node->keys + node->size, node->keys);
+        node->size--;
+        return key;
+    }
+    
+    // Доводит ребёнка index до t ключей и возвращает его новый индекс
+    size_t fillChild(Node *node, size_t index)
+    {
+        if (node->children[index]->size >= t)
+            return index;
+        
+        if (index > 0 && node->children[index - 1]->size >= t)
+        {
+            borrowFromLeft(node, index);
+            return index;
+        }
+        
+        if (index < node->size && node->children[index + 1]->size >= t)
+        {
+            borrowFromRight(node, index);
+            return index;
+        }
+        
+        if (index < node->size)
+        {
+            mergeChildren(node, index);
+            return index;
+        }
+        
+        mergeChildren(node, index - 1);
+        return index - 1;
+    }
+    
+    // Ключ-разделитель уходит в ребёнка, его место занимает последний ключ левого соседа
+    void borrowFromLeft(Node *node, size_t index)
+    {
+        Node *child = node->children[index];
+        Node *sibling = node->children[index - 1];
+        
+        // Листья B+-дерева передают ключ напрямую и обновляют копию в разделителе
+        if (linkedLeaves && child->leaf)
+        {
+            std::move_backward(child->keys, child->keys + child->size, child->keys + child->size + 1);
+            child->keys[0] = std::move(sibling->keys[sibling->size - 1]);
+            node->keys[index - 1] = child->keys[0];
+            
+            child->size++;
+            sibling->size--;
+            return;
+        }
+        
+        std::move_backward(child->keys, child->keys + child->size, child->keys + child->size + 1);
+        child->keys[0] = std::move(node->keys[index - 1]);
+        
+        if (!child->leaf)
+        {
+            std::copy_backward(child->children, child->children + child->size + 1,
+                               child->children + child->size + 2);
+            child->children[0] = sibling->children[sibling->size];
+        }
+        
+        node->keys[index - 1] = std::move(sibling->keys[sibling->size - 1]);
+        
+        child->size++;
+        sibling->size--;
+    }
+    
+    void borrowFromRight(Node *node, size_t index)
+    {
+        Node *child = node->children[index];
+        Node *sibling = node->children[index + 1];
+        
+        if (linkedLeaves && child->leaf)
+        {
+            child->keys[child->size] = std::move(sibling->keys[0]);
+            std::move(sibling->keys + 1, sibling->keys + sibling->size, sibling->keys);
+            node->keys[index] = sibling->keys[0];
+            
+            child->size++;
+            sibling->size--;
+            return;
+        }
+        
+        child->keys[child->size] = std::move(node->keys[index]);
+        node->keys[index] = std::move(sibling->keys[0]);
+        std::move(sibling->keys + 1, sibling->keys + sibling->size, sibling->keys);
+        
+        if (!child->leaf)
+        {
+            child->children[child->size + 1] = sibling->children[0];
+            std::copy(sibling->children + 1, sibling->children + sibling->size + 1, sibling->children);
+        }
+        
+        child->size++;
+        sibling->size--;
+    }
+    
+    // Сливает детей index и index + 1 по t-1 ключей через разделитель в один полный узел
+    void mergeChildren(Node *node, size_t index)
+    {
+        Node *left = node->children[index];
+        Node *right = node->children[index + 1];
+        
+        // Листья B+-дерева сливаются без разделителя, он только копия ключа
+        if (linkedLeaves && left->leaf)
+        {
+            std::move(right->keys, right->keys + right->size, left->keys + left->size);
+            left->size += right->size;
+            left->next = right->next;
+        }
+        else
+        {
+            left->keys[left->size] = std::move(node->keys[index]);
+            std::move(right->keys, right->keys + right->size, left->keys + left->size + 1);
+            
+            if (!left->leaf)
+                std::copy(right->children, right->children + right->size + 1, left->children + left->size + 1);
+            
+            left->size += right->size + 1;
         }
+        
+        std::move(node->keys + index + 1, node->keys + node->size, node->keys + index);
+        std::copy(node->children + index + 2, node->children + node->size + 1, node->children + index + 1);
+        node->size--;
+        
+        freeNode(right);
     }
     
     size_t t;
     Node *root;
     Compare comp;
+    
+    static const size_t nodeAlignment = alignof(Node) > alignof(T) ? alignof(Node) : alignof(T);
+    
+    size_t keysOffset;
+    size_t childrenOffset;
+    
+    NodePool leafPool;
+    NodePool innerPool;
 };
 
+#ifdef BTREE_TEST
+/*
+Случайная проверка против std::multiset: вставки, удаления, Find,
+LowerBound и UpperBound на ключах из диапазонов разной ширины (в узких
+много повторов) и время от времени полный обход. Часть прогонов начинается
+с BulkLoad. Печатает число расхождений.
+Сборка: g++ -O2 -std=c++17 -pthread -DBTREE_TEST task_3.cpp
+*/
+#define TEST_OPERATIONS 200000
+
+template <BTreeLayout Layout>
+size_t checkAgainstMultiset(size_t t, int keyRange, bool bulk, unsigned seed)
+{
+    std::mt19937 random(seed);
+    BTree<int, std::less<int>, Layout> tree(t);
+    std::multiset<int> expected;
+    size_t errors = 0;
+    
+    if (bulk)
+    {
+        std::vector<int> keys(random() % 5000);
+        for (int &key : keys)
+            key = int(random() % keyRange);
+        std::sort(keys.begin(), keys.end());
+        
+        tree.BulkLoad(keys.begin(), keys.end(), 0.5 + (random() % 6) / 10.0);
+        expected.insert(keys.begin(), keys.end());
+    }
+    
+    for (size_t i = 0; i < TEST_OPERATIONS; i++)
+    {
+        int key = int(random() % keyRange);
+        
+        // Сначала дерево растёт, потом вставки и удаления идут поровну, в конце оно пустеет
+        unsigned insertPercent = i < TEST_OPERATIONS / 3 ? 60 : i < TEST_OPERATIONS * 2 / 3 ? 50 : 35;
+        unsigned operation = random() % 100;
+        
+        if (operation < insertPercent)
+        {
+            tree.Insert(key);
+            expected.insert(key);
+        }
+        else if (operation < 80)
+        {
+            auto it = expected.find(key);
+            bool erased = it != expected.end();
+            if (erased)
+                expected.erase(it);
+            
+            errors += tree.Erase(key) != erased;
+        }
+        else if (operation < 90)
+        {
+            const int *found = tree.Find(key);
+            errors += (found != nullptr) != (expected.count(key) != 0) || (found && *found != key);
+        }
+        else
+        {
+            auto lower = tree.LowerBound(key);
+            auto upper = tree.UpperBound(key);
+            auto expectedLower = expected.lower_bound(key);
+            auto expectedUpper = expected.upper_bound(key);
+            
+            errors += (lower == tree.end()) != (expectedLower == expected.end()) ||
+                      (lower != tree.end() && *lower != *expectedLower);
+            errors += (upper == tree.end()) != (expectedUpper == expected.end()) ||
+                      (upper != tree.end() && *upper != *expectedUpper);
+        }
+        
+        if (i % 5000 == 0 || i + 1 == TEST_OPERATIONS)
+            errors += !std::equal(tree.begin(), tree.end(), expected.begin(), expected.end());
+    }
+    
+    return errors;
+}
+
+int main()
+{
+    size_t errors = 0;
+    unsigned seed = 1;
+    
+    for (size_t t : {2, 3, 4, 7, 16})
+    {
+        for (int keyRange : {50, 1000, 1 << 30})
+        {
+            for (bool bulk : {false, true})
+            {
+                size_t classic = checkAgainstMultiset<BTreeLayout::Classic>(t, keyRange, bulk, seed);
+                size_t bplus = checkAgainstMultiset<BTreeLayout::BPlus>(t, keyRange, bulk, seed);
+                seed++;
+                
+                if (classic || bplus)
+                    std::cout << "t=" << t << " range=" << keyRange << " bulk=" << bulk
+                              << ": classic " << classic << ", bplus " << bplus << " errors\n";
+                errors += classic + bplus;
+            }
+        }
+    }
+    
+    std::cout << (errors ? "FAILED, errors: " : "OK, errors: ") << errors << std::endl;
+    return errors ? 1 : 0;
+}
+#elif defined(BTREE_BENCH)
+/*
+Замеры дерева, первый аргумент выбирает замер:
+mixed (по умолчанию) — поток вставок и удалений случайных ключей
+в дерево из MIXED_KEYS ключей для обеих раскладок и std::multiset;
+bulk — построение из BULK_KEYS ключей вставками и через BulkLoad;
+scan — скорость упорядоченного обхода классического и B+-дерева.
+Сборка: g++ -O2 -std=c++17 -pthread -DBTREE_BENCH task_3.cpp
+*/
+#define MIXED_KEYS (1 << 20)
+#define MIXED_OPERATIONS (1 << 23)
+
+double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Миллионы операций в секунду; удаляется ключ, вставленный MIXED_KEYS операций назад
+template <typename Insert, typename Erase>
+double benchMixed(const std::vector<uint32_t> &keys, Insert insert, Erase erase)
+{
+    for (size_t i = 0; i < MIXED_KEYS; i++)
+        insert(keys[i]);
+    
+    size_t erased = 0;
+    auto start = std::chrono::steady_clock::now();
+    
+    for (size_t i = MIXED_KEYS; i < MIXED_KEYS + MIXED_OPERATIONS / 2; i++)
+    {
+        insert(keys[i]);
+        erased += erase(keys[i - MIXED_KEYS]);
+    }
+    
+    double seconds = secondsSince(start);
+    return erased == MIXED_OPERATIONS / 2 ? MIXED_OPERATIONS / seconds / 1e6 : 0;
+}
+
+void runMixedBench(std::ostream &out)
+{
+    std::mt19937 random(1);
+    std::vector<uint32_t> keys(MIXED_KEYS + MIXED_OPERATIONS / 2);
+    for (uint32_t &key : keys)
+        key = uint32_t(random());
+    
+    out.setf(std::ios::fixed);
+    out.precision(2);
+    out << MIXED_KEYS << " keys, " << MIXED_OPERATIONS << " inserts and erases, Mops/s\n";
+    
+    for (size_t t : {2, 8, 32, 128})
+    {
+        BTree<uint32_t> classic(t);
+        BTree<uint32_t, std::less<uint32_t>, BTreeLayout::BPlus> bplus(t);
+        
+        out << "t=" << t << ": classic "
+            << benchMixed(keys, [&](uint32_t key) { classic.Insert(key); },
+                          [&](uint32_t key) { return classic.Erase(key); })
+            << ", bplus "
+            << benchMixed(keys, [&](uint32_t key) { bplus.Insert(key); },
+                          [&](uint32_t key) { return bplus.Erase(key); })
+            << '\n';
+    }
+    
+    std::multiset<uint32_t> set;
+    out << "std::multiset: "
+        << benchMixed(keys, [&](uint32_t key) { set.insert(key); },
+                      [&](uint32_t key) { return set.erase(set.find(key)), true; })
+        << '\n';
+}
+
+/*
+Вставки идут в случайном и в отсортированном порядке, BulkLoad получает
+уже отсортированные ключи, время сортировки печатается отдельно.
+После построения обход дерева сверяется с отсортированными ключами.
+*/
+#define BULK_KEYS (1 << 22)
+
+template <BTreeLayout Layout>
+void benchBulk(std::ostream &out, const char *name, size_t t,
+               const std::vector<uint32_t> &keys, const std::vector<uint32_t> &sorted)
+{
+    typedef BTree<uint32_t, std::less<uint32_t>, Layout> Tree;
+    
+    out << name << " t=" << t << ", ms: insert random ";
+    {
+        auto start = std::chrono::steady_clock::now();
+        Tree tree(t);
+        for (uint32_t key : keys)
+            tree.Insert(key);
+        out << secondsSince(start) * 1e3;
+        
+        if (!std::equal(tree.begin(), tree.end(), sorted.begin(), sorted.end()))
+            out << " (wrong)";
+    }
+    
+    out << ", insert sorted ";
+    {
+        auto start = std::chrono::steady_clock::now();
+        Tree tree(t);
+        for (uint32_t key : sorted)
+            tree.Insert(key);
+        out << secondsSince(start) * 1e3;
+    }
+    
+    for (double fillFactor : {1.0, 0.7})
+    {
+        auto start = std::chrono::steady_clock::now();
+        Tree tree(t);
+        tree.BulkLoad(sorted.begin(), sorted.end(), fillFactor);
+        out << ", BulkLoad " << fillFactor << " " << secondsSince(start) * 1e3;
+        
+        if (!std::equal(tree.begin(), tree.end(), sorted.begin(), sorted.end()))
+            out << " (wrong)";
+    }
+    out << '\n';
+}
+
+void runBulkBench(std::ostream &out)
+{
+    std::mt19937 random(1);
+    std::vector<uint32_t> keys(BULK_KEYS);
+    for (uint32_t &key : keys)
+        key = uint32_t(random());
+    
+    auto start = std::chrono::steady_clock::now();
+    std::vector<uint32_t> sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << BULK_KEYS << " keys, sort " << secondsSince(start) * 1e3 << " ms\n";
+    
+    for (size_t t : {2, 8, 32, 128})
+    {
+        benchBulk<BTreeLayout::Classic>(out, "classic", t, keys, sorted);
+        benchBulk<BTreeLayout::BPlus>(out, "bplus", t, keys, sorted);
+    }
+}
+
+/*
+Дерево из SCAN_KEYS ключей строится BulkLoad с заполнением 0.7.
+Полный обход проходит все ключи от begin() до end(), обход диапазона
+начинается с LowerBound случайного ключа и читает length ключей;
+диапазонов столько, чтобы всего прочитать SCAN_KEYS ключей.
+Печатаются миллионы ключей в секунду.
+*/
+#define SCAN_KEYS (1 << 22)
+
+template <typename Tree>
+double benchFullScan(const Tree &tree)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    uint64_t sum = 0;
+    size_t count = 0;
+    for (uint32_t key : tree)
+    {
+        sum += key;
+        count++;
+    }
+    
+    double seconds = secondsSince(start);
+    return sum != 0 && count == SCAN_KEYS ? count / seconds / 1e6 : 0;
+}
+
+template <typename Tree>
+double benchRangeScan(const Tree &tree, const std::vector<uint32_t> &starts, size_t length)
+{
+    auto start = std::chrono::steady_clock::now();
+    
+    uint64_t sum = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < SCAN_KEYS / length; i++)
+    {
+        auto it = tree.LowerBound(starts[i]);
+        for (size_t j = 0; j < length && it != tree.end(); j++, ++it)
+        {
+            sum += *it;
+            count++;
+        }
+    }
+    
+    double seconds = secondsSince(start);
+    return sum != 0 ? count / seconds / 1e6 : 0;
+}
+
+template <BTreeLayout Layout>
+void benchScan(std::ostream &out, const char *name, size_t t,
+               const std::vector<uint32_t> &sorted, const std::vector<uint32_t> &starts)
+{
+    BTree<uint32_t, std::less<uint32_t>, Layout> tree(t);
+    tree.BulkLoad(sorted.begin(), sorted.end(), 0.7);
+    
+    out << name << " t=" << t << ": full " << benchFullScan(tree);
+    for (size_t length : {10, 100, 1000})
+        out << ", range " << length << " " << benchRangeScan(tree, starts, length);
+    out << '\n';
+}
+
+void runScanBench(std::ostream &out)
+{
+    std::mt19937 random(1);
+    std::vector<uint32_t> sorted(SCAN_KEYS);
+    for (uint32_t &key : sorted)
+        key = uint32_t(random());
+    std::sort(sorted.begin(), sorted.end());
+    
+    std::vector<uint32_t> starts(SCAN_KEYS / 10);
+    for (uint32_t &key : starts)
+        key = uint32_t(random());
+    
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << SCAN_KEYS << " keys, Mkeys/s\n";
+    
+    for (size_t t : {2, 8, 32, 128})
+    {
+        benchScan<BTreeLayout::Classic>(out, "classic", t, sorted, starts);
+        benchScan<BTreeLayout::BPlus>(out, "bplus", t, sorted, starts);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string bench = argc > 1 ? argv[1] : "mixed";
+    
+    if (bench == "mixed")
+        runMixedBench(std::cout);
+    else if (bench == "bulk")
+        runBulkBench(std::cout);
+    else if (bench == "scan")
+        runScanBench(std::cout);
+    else
+    {
+        std::cerr << "unknown benchmark " << bench << std::endl;
+        return 1;
+    }
+    return 0;
+}
+#else
 int main() {
     size_t t;
     std::cin >> t;
@@ -172,4 +1461,5 @@ int main() {
     );
     
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
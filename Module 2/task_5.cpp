@@ -12,19 +12,58 @@
 #include <map>
 #include <unordered_map>
 #include <algorithm>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+
+#ifdef HUFFMAN_BENCH
+#include <chrono>
+#include <functional>
+#include <random>
+#endif
+
+// Редкий медленный путь выносится из цикла декодирования, чтобы цикл оставался маленьким
+#if defined(__GNUC__)
+#define HUFFMAN_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define HUFFMAN_NOINLINE __declspec(noinline)
+#else
+#define HUFFMAN_NOINLINE
+#endif
+
+const byte MODE_SINGLE = 0;
+const byte MODE_CHUNKED = 1;
+const byte MODE_INTERLEAVED = 2;
+
+const size_t MIN_CHUNK_SIZE = 1 << 20;
+const size_t MAX_CHUNK_COUNT = 0xFFFF;
+
+// Размер исходных данных пишется в заголовок 32 битами, поэтому вход не больше 4 ГиБ
+const size_t MAX_ORIGINAL_SIZE = 0xFFFFFFFF;
+
+const size_t INTERLEAVED_STREAMS = 4;
+const size_t MIN_INTERLEAVED_SIZE = 1 << 16;
+const int DECODE_TABLE_BITS = 11;
+
+// После refill в буфере не меньше 56 битов, а код из таблицы не длиннее
+// DECODE_TABLE_BITS, поэтому одного дополнения хватает на столько символов.
+// Длинный код дополняет буфер сам
+const size_t SYMBOLS_PER_REFILL = 4;
 
 class BitWriter {
 private:
     IOutputStream& output;
     byte buffer;          
     int bitsInBuffer;     
+    size_t bitsWritten;
     
 public:
-    BitWriter(IOutputStream& out) : output(out), buffer(0), bitsInBuffer(0) {}
+    BitWriter(IOutputStream& out) : output(out), buffer(0), bitsInBuffer(0), bitsWritten(0) {}
     
     void writeBit(bool bit) {
         buffer = (buffer << 1) | (bit ? 1 : 0);
         bitsInBuffer++;
+        bitsWritten++;
         
         if (bitsInBuffer == 8) {
             output.Write(buffer);
@@ -47,9 +86,15 @@ public:
         if (bitsInBuffer > 0) {
             buffer <<= (8 - bitsInBuffer);
             output.Write(buffer);
+            buffer = 0;
+            bitsInBuffer = 0;
         }
     }
     
+    size_t bitCount() const {
+        return bitsWritten;
+    }
+    
     ~BitWriter() {
         flush();
     }
@@ -97,9 +142,94 @@ public:
         return readBits(8);
     }
     
+    void alignToByte() {
+        bitsInBuffer = 0;
+    }
+    
     bool isEndOfStream() const {
         return endOfStream;
     }
+    
+    // Последний прочитанный байт и число его ещё не выданных младших битов
+    byte currentByte() const {
+        return buffer;
+    }
+    
+    int bitsLeft() const {
+        return bitsInBuffer;
+    }
+};
+
+class ByteVectorOutputStream : public IOutputStream {
+private:
+    std::vector<byte>& data;
+    
+public:
+    ByteVectorOutputStream(std::vector<byte>& out) : data(out) {}
+    
+    void Write(byte value) override {
+        data.push_back(value);
+    }
+};
+
+// Читает биты из памяти через 64-битный буфер, старшие биты идут первыми
+class MemoryBitReader {
+private:
+    const byte* current;
+    const byte* end;
+    uint64_t bits;
+    int bitsInBuffer;
+    
+    // Компиляторы собирают это выражение в одну загрузку с перестановкой байтов
+    static uint64_t loadBigEndian(const byte* p) {
+        return (uint64_t(p[0]) << 56) | (uint64_t(p[1]) << 48) | (uint64_t(p[2]) << 40) |
+               (uint64_t(p[3]) << 32) | (uint64_t(p[4]) << 24) | (uint64_t(p[5]) << 16) |
+               (uint64_t(p[6]) << 8) | uint64_t(p[7]);
+    }
+    
+    // Последние байты до end читаются по одному, за концом идут нули
+    void refillTail() {
+        while (bitsInBuffer <= 56) {
+            uint64_t value = current < end ? *current++ : 0;
+            bits |= value << (56 - bitsInBuffer);
+            bitsInBuffer += 8;
+        }
+    }
+    
+public:
+    MemoryBitReader(const byte* begin, const byte* end)
+        : current(begin), end(end), bits(0), bitsInBuffer(0) {}
+    
+    // Дополняет буфер до 56-63 битов одной 8-байтовой загрузкой без цикла.
+    // Младшие биты сверх счётчика уже содержат следующие байты потока,
+    // поэтому следующая загрузка пишет в них те же значения
+    void refill() {
+        if (end - current >= 8) {
+            bits |= loadBigEndian(current) >> bitsInBuffer;
+            current += (63 - bitsInBuffer) >> 3;
+            bitsInBuffer |= 56;
+        } else {
+            refillTail();
+        }
+    }
+    
+    unsigned peekBits(int numBits) const {
+        return static_cast<unsigned>(bits >> (64 - numBits));
+    }
+    
+    void skipBits(int numBits) {
+        bits <<= numBits;
+        bitsInBuffer -= numBits;
+    }
+    
+    bool readBit() {
+        if (bitsInBuffer == 0) {
+            refill();
+        }
+        bool bit = peekBits(1);
+        skipBits(1);
+        return bit;
+    }
 };
 
 class BufferedInputStream : public IInputStream {
@@ -191,9 +321,75 @@ private:
         }
     };
     
+    // Элемент таблицы декодирования: символ value с длиной кода length, если код
+    // не длиннее DECODE_TABLE_BITS. Иначе length == 0, и символ ищется по дереву.
+    // Два байта на элемент, чтобы вся таблица лежала в кеше L1
+    struct DecodeEntry {
+        byte value;
+        byte length;
+    };
+    
     Node* root;
     std::unordered_map<byte, std::string> codes;
     
+    std::vector<DecodeEntry> buildDecodeTable() const {
+        std::vector<DecodeEntry> table(1 << DECODE_TABLE_BITS);
+        
+        for (unsigned prefix = 0; prefix < table.size(); prefix++) {
+            const Node* current = root;
+            int length = 0;
+            
+            while (current && !current->isLeaf() && length < DECODE_TABLE_BITS) {
+                bool bit = (prefix >> (DECODE_TABLE_BITS - 1 - length)) & 1;
+                current = bit ? current->right : current->left;
+                length++;
+            }
+            
+            if (current && current->isLeaf() && length > 0) {
+                table[prefix] = { current->value, static_cast<byte>(length) };
+            } else {
+                table[prefix] = { 0, 0 };
+            }
+        }
+        
+        return table;
+    }
+    
+    // Код длиннее таблицы: спуск идёт от корня по одному биту.
+    // reader передаётся и возвращается по значению, чтобы адрес читателя
+    // не уходил из цикла декодирования и его поля оставались в регистрах.
+    // symbol получает символ или -1 для испорченного дерева
+    HUFFMAN_NOINLINE static MemoryBitReader decodeLongCode(const Node* root, MemoryBitReader reader, int& symbol) {
+        symbol = -1;
+        
+        const Node* current = root;
+        while (current && !current->isLeaf()) {
+            current = reader.readBit() ? current->right : current->left;
+        }
+        reader.refill();
+        
+        if (current) {
+            symbol = current->value;
+        }
+        return reader;
+    }
+    
+    // В буфере reader должно быть не меньше DECODE_TABLE_BITS битов
+    static bool decodeSymbol(const DecodeEntry* table, const Node* root, MemoryBitReader& reader, byte& value) {
+        const DecodeEntry& entry = table[reader.peekBits(DECODE_TABLE_BITS)];
+        
+        if (entry.length != 0) {
+            reader.skipBits(entry.length);
+            value = entry.value;
+            return true;
+        }
+        
+        int symbol = -1;
+        reader = decodeLongCode(root, reader, symbol);
+        value = static_cast<byte>(symbol);
+        return symbol >= 0;
+    }
+    
     void generateCodes(Node* node, std::string code) {
         if (node == nullptr) return;
         
@@ -326,29 +522,131 @@ public:
         }
     }
     
-    void decode(BitReader& reader, IOutputStream& output, size_t originalSize) const {
+    void encodeRange(const byte* begin, const byte* end, BitWriter& writer) const {
         if (!isBuilt()) {
             return;
         }
         
-        Node* current = root;
-        size_t bytesDecoded = 0;
+        for (const byte* it = begin; it != end; ++it) {
+            auto code = codes.find(*it);
+            for (char bit : code->second) {
+                writer.writeBit(bit == '1');
+            }
+        }
+    }
+    
+    // Символ i попадает в поток i % INTERLEAVED_STREAMS
+    void encodeInterleaved(const std::vector<byte>& data, std::vector<std::vector<byte>>& streams,
+                           std::vector<size_t>& streamBits) const {
+        streams.assign(INTERLEAVED_STREAMS, std::vector<byte>());
+        streamBits.assign(INTERLEAVED_STREAMS, 0);
         
-        while (bytesDecoded < originalSize && !reader.isEndOfStream()) {
-            bool bit = reader.readBit();
+        std::vector<ByteVectorOutputStream> outputs(streams.begin(), streams.end());
+        std::vector<BitWriter> writers(outputs.begin(), outputs.end());
+        
+        for (size_t i = 0; i < data.size(); i++) {
+            auto code = codes.find(data[i]);
+            BitWriter& writer = writers[i % INTERLEAVED_STREAMS];
+            for (char bit : code->second) {
+                writer.writeBit(bit == '1');
+            }
+        }
+        
+        for (size_t i = 0; i < INTERLEAVED_STREAMS; i++) {
+            streamBits[i] = writers[i].bitCount();
+            writers[i].flush();
+        }
+    }
+    
+    // За одну итерацию продвигаются все потоки, так что их цепочки зависимостей
+    // по битам выполняются процессором параллельно. Состояния читателей лежат
+    // в локальных переменных, а четыре символа шага собираются в group и пишутся
+    // одной записью: иначе запись байта в output могла бы менять читателей,
+    // и компилятор сохранял бы и перечитывал их поля на каждом символе
+    void decodeInterleaved(std::vector<MemoryBitReader>& readers, std::vector<byte>& output) const {
+        if (!isBuilt() || readers.size() != INTERLEAVED_STREAMS) {
+            output.clear();
+            return;
+        }
+        
+        std::vector<DecodeEntry> decodeTable = buildDecodeTable();
+        const DecodeEntry* table = decodeTable.data();
+        const Node* tree = root;
+        
+        MemoryBitReader reader0 = readers[0];
+        MemoryBitReader reader1 = readers[1];
+        MemoryBitReader reader2 = readers[2];
+        MemoryBitReader reader3 = readers[3];
+        
+        const size_t groupSize = INTERLEAVED_STREAMS * SYMBOLS_PER_REFILL;
+        byte* out = output.data();
+        size_t size = output.size();
+        size_t blockEnd = size - size % groupSize;
+        bool valid = true;
+        
+        for (size_t i = 0; i < blockEnd && valid; i += groupSize) {
+            reader0.refill();
+            reader1.refill();
+            reader2.refill();
+            reader3.refill();
             
-            if (bit) {
-                current = current->right;
-            } else {
-                current = current->left;
+            for (size_t j = 0; j < groupSize; j += INTERLEAVED_STREAMS) {
+                byte group[INTERLEAVED_STREAMS];
+                valid &= decodeSymbol(table, tree, reader0, group[0]) &
+                         decodeSymbol(table, tree, reader1, group[1]) &
+                         decodeSymbol(table, tree, reader2, group[2]) &
+                         decodeSymbol(table, tree, reader3, group[3]);
+                std::memcpy(out + i + j, group, INTERLEAVED_STREAMS);
             }
+        }
+        
+        readers[0] = reader0;
+        readers[1] = reader1;
+        readers[2] = reader2;
+        readers[3] = reader3;
+        
+        for (size_t i = blockEnd; i < size && valid; i++) {
+            MemoryBitReader& reader = readers[i % INTERLEAVED_STREAMS];
+            reader.refill();
+            valid = decodeSymbol(table, tree, reader, out[i]);
+        }
+        
+        if (!valid) {
+            output.clear();
+        }
+    }
+    
+    // Декодирует один поток в output.size() байт. При ошибке output очищается
+    void decode(MemoryBitReader& reader, std::vector<byte>& output) const {
+        if (!isBuilt()) {
+            output.clear();
+            return;
+        }
+        
+        std::vector<DecodeEntry> decodeTable = buildDecodeTable();
+        const DecodeEntry* table = decodeTable.data();
+        const Node* tree = root;
+        MemoryBitReader localReader = reader;
+        
+        byte* out = output.data();
+        size_t size = output.size();
+        bool valid = true;
+        
+        for (size_t i = 0; i < size && valid; i += SYMBOLS_PER_REFILL) {
+            localReader.refill();
             
-            if (current && current->isLeaf()) {
-                output.Write(current->value);
-                bytesDecoded++;
-                current = root;
+            size_t groupEnd = std::min(i + SYMBOLS_PER_REFILL, size);
+            for (size_t j = i; j < groupEnd; j++) {
+                valid &= decodeSymbol(table, tree, localReader, out[j]);
             }
         }
+        
+        if (!valid) {
+            output.clear();
+            return;
+        }
+        
+        reader = localReader;
     }
     
     static std::map<byte, unsigned> countFrequencies(IInputStream& input) {
@@ -361,20 +659,278 @@ public:
         
         return frequencies;
     }
+    
+    // Каждый поток считает гистограмму своего чанка, затем они сливаются в одну таблицу
+    static std::map<byte, unsigned> countFrequencies(const std::vector<byte>& data, size_t chunkCount) {
+        size_t chunkSize = (data.size() + chunkCount - 1) / chunkCount;
+        std::vector<std::vector<unsigned>> histograms(chunkCount, std::vector<unsigned>(256, 0));
+        std::vector<std::thread> workers;
+        
+        for (size_t i = 0; i < chunkCount; i++) {
+            workers.emplace_back([&data, &histograms, chunkSize, i]() {
+                size_t begin = std::min(i * chunkSize, data.size());
+                size_t end = std::min(begin + chunkSize, data.size());
+                std::vector<unsigned>& histogram = histograms[i];
+                
+                for (size_t j = begin; j < end; j++) {
+                    histogram[data[j]]++;
+                }
+            });
+        }
+        
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        
+        std::map<byte, unsigned> frequencies;
+        for (int symbol = 0; symbol < 256; symbol++) {
+            unsigned total = 0;
+            for (const std::vector<unsigned>& histogram : histograms) {
+                total += histogram[symbol];
+            }
+            if (total > 0) {
+                frequencies[static_cast<byte>(symbol)] = total;
+            }
+        }
+        
+        return frequencies;
+    }
 };
 
+size_t chooseChunkCount(size_t size) {
+    size_t threads = std::thread::hardware_concurrency();
+    size_t chunkCount = std::min(threads, size / MIN_CHUNK_SIZE);
+    chunkCount = std::min(chunkCount, MAX_CHUNK_COUNT);
+    
+    return chunkCount > 1 ? chunkCount : 1;
+}
+
+// Байты читаются по одному: порядок вычисления операндов в одном выражении не задан
+uint32_t readUInt32(BitReader& reader) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value = (value << 8) | reader.readByte();
+    }
+    return value;
+}
+
+// Длина буфера в битах занимает 64 бита: в 32 битах не помещается уже чанк больше 512 МиБ
+void writeBitLength(BitWriter& writer, size_t bits) {
+    writer.writeBits(static_cast<unsigned>(static_cast<uint64_t>(bits) >> 32), 32);
+    writer.writeBits(static_cast<unsigned>(bits & 0xFFFFFFFF), 32);
+}
+
+size_t readBitLength(BitReader& reader) {
+    uint64_t high = reader.readBits(32);
+    uint64_t low = reader.readBits(32);
+    return static_cast<size_t>((high << 32) | low);
+}
+
+// Переводит длины буферов в битах в их смещения в payload.
+// Возвращает false, если буферы не помещаются в payloadSize байт.
+bool bitLengthsToOffsets(const std::vector<size_t>& bitLengths, size_t payloadSize, std::vector<size_t>& offsets) {
+    offsets.assign(bitLengths.size() + 1, 0);
+    
+    for (size_t i = 0; i < bitLengths.size(); i++) {
+        size_t bytes = bitLengths[i] / 8 + (bitLengths[i] % 8 != 0);
+        if (bytes > payloadSize - offsets[i]) {
+            return false;
+        }
+        offsets[i + 1] = offsets[i] + bytes;
+    }
+    
+    return true;
+}
+
+// Каждый чанк кодируется в собственный битовый буфер, выровненный по байту.
+// В заголовок пишутся длины чанков в битах, по ним декодер находит начало каждого чанка.
+void encodeChunked(const HuffmanTree& huffmanTree, const std::vector<byte>& data,
+                   size_t chunkCount, BitWriter& writer, IOutputStream& compressed) {
+    size_t chunkSize = (data.size() + chunkCount - 1) / chunkCount;
+    std::vector<std::vector<byte>> chunks(chunkCount);
+    std::vector<size_t> chunkBits(chunkCount, 0);
+    std::vector<std::thread> workers;
+    
+    for (size_t i = 0; i < chunkCount; i++) {
+        workers.emplace_back([&, i]() {
+            size_t begin = std::min(i * chunkSize, data.size());
+            size_t end = std::min(begin + chunkSize, data.size());
+            
+            ByteVectorOutputStream chunkOutput(chunks[i]);
+            BitWriter chunkWriter(chunkOutput);
+            huffmanTree.encodeRange(data.data() + begin, data.data() + end, chunkWriter);
+            chunkBits[i] = chunkWriter.bitCount();
+            chunkWriter.flush();
+        });
+    }
+    
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    
+    writer.writeBits(chunkCount, 16);
+    for (size_t bits : chunkBits) {
+        writeBitLength(writer, bits);
+    }
+    writer.flush();
+    
+    for (const std::vector<byte>& chunk : chunks) {
+        for (byte value : chunk) {
+            compressed.Write(value);
+        }
+    }
+}
+
+void decodeChunked(const HuffmanTree& huffmanTree, BitReader& reader,
+                   IInputStream& compressed, IOutputStream& original, size_t originalSize) {
+    size_t chunkCount = reader.readBits(16);
+    if (chunkCount == 0) {
+        return;
+    }
+    
+    std::vector<size_t> chunkBits(chunkCount);
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunkBits[i] = readBitLength(reader);
+    }
+    reader.alignToByte();
+    
+    BufferedInputStream payloadInput(compressed);
+    const std::vector<byte>& payload = payloadInput.getData();
+    
+    std::vector<size_t> chunkOffsets;
+    if (!bitLengthsToOffsets(chunkBits, payload.size(), chunkOffsets) || originalSize / 8 > payload.size()) {
+        return;
+    }
+    
+    size_t chunkSize = (originalSize + chunkCount - 1) / chunkCount;
+    std::vector<std::vector<byte>> chunks(chunkCount);
+    std::vector<std::thread> workers;
+    
+    // Число чанков пришло из потока, поэтому потоков не больше, чем ядер
+    size_t workerCount = std::min(chunkCount, std::max<size_t>(1, std::thread::hardware_concurrency()));
+    
+    for (size_t worker = 0; worker < workerCount; worker++) {
+        workers.emplace_back([&, worker]() {
+            for (size_t i = worker; i < chunkCount; i += workerCount) {
+                size_t begin = std::min(i * chunkSize, originalSize);
+                size_t end = std::min(begin + chunkSize, originalSize);
+                
+                MemoryBitReader chunkReader(payload.data() + chunkOffsets[i], payload.data() + chunkOffsets[i + 1]);
+                chunks[i].resize(end - begin);
+                huffmanTree.decode(chunkReader, chunks[i]);
+            }
+        });
+    }
+    
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    
+    size_t decodedSize = 0;
+    for (const std::vector<byte>& chunk : chunks) {
+        decodedSize += chunk.size();
+    }
+    if (decodedSize != originalSize) {
+        return;
+    }
+    
+    for (const std::vector<byte>& chunk : chunks) {
+        for (byte value : chunk) {
+            original.Write(value);
+        }
+    }
+}
+
+void encodeInterleaved(const HuffmanTree& huffmanTree, const std::vector<byte>& data,
+                       BitWriter& writer, IOutputStream& compressed) {
+    std::vector<std::vector<byte>> streams;
+    std::vector<size_t> streamBits;
+    huffmanTree.encodeInterleaved(data, streams, streamBits);
+    
+    for (size_t bits : streamBits) {
+        writeBitLength(writer, bits);
+    }
+    writer.flush();
+    
+    for (const std::vector<byte>& stream : streams) {
+        for (byte value : stream) {
+            compressed.Write(value);
+        }
+    }
+}
+
+void decodeInterleaved(const HuffmanTree& huffmanTree, BitReader& reader,
+                       IInputStream& compressed, IOutputStream& original, size_t originalSize) {
+    std::vector<size_t> streamBits(INTERLEAVED_STREAMS);
+    for (size_t i = 0; i < INTERLEAVED_STREAMS; i++) {
+        streamBits[i] = readBitLength(reader);
+    }
+    reader.alignToByte();
+    
+    BufferedInputStream payloadInput(compressed);
+    const std::vector<byte>& payload = payloadInput.getData();
+    
+    std::vector<size_t> streamOffsets;
+    if (!bitLengthsToOffsets(streamBits, payload.size(), streamOffsets) || originalSize / 8 > payload.size()) {
+        return;
+    }
+    
+    std::vector<MemoryBitReader> readers;
+    for (size_t i = 0; i < INTERLEAVED_STREAMS; i++) {
+        readers.emplace_back(payload.data() + streamOffsets[i], payload.data() + streamOffsets[i + 1]);
+    }
+    
+    std::vector<byte> decoded(originalSize);
+    huffmanTree.decodeInterleaved(readers, decoded);
+    
+    for (byte value : decoded) {
+        original.Write(value);
+    }
+}
+
+// Код начинается с ещё не выданных битов текущего байта reader,
+// поэтому этот байт кладётся в начало буфера и его прочитанные биты пропускаются
+void decodeSingle(const HuffmanTree& huffmanTree, BitReader& reader,
+                  IInputStream& compressed, IOutputStream& original, size_t originalSize) {
+    std::vector<byte> payload(1, reader.currentByte());
+    byte value;
+    while (compressed.Read(value)) {
+        payload.push_back(value);
+    }
+    
+    // Каждый символ занимает хотя бы один бит
+    if (originalSize / 8 > payload.size()) {
+        return;
+    }
+    
+    MemoryBitReader payloadReader(payload.data(), payload.data() + payload.size());
+    payloadReader.refill();
+    payloadReader.skipBits(8 - reader.bitsLeft());
+    
+    std::vector<byte> decoded(originalSize);
+    huffmanTree.decode(payloadReader, decoded);
+    
+    for (byte b : decoded) {
+        original.Write(b);
+    }
+}
+
 void Encode(IInputStream& original, IOutputStream& compressed)
 {
     BufferedInputStream bufferedInput(original);
     bufferedInput.bufferInput();
     
     const std::vector<byte>& originalData = bufferedInput.getData();
-    if (originalData.empty()) {
+    if (originalData.empty() || originalData.size() > MAX_ORIGINAL_SIZE) {
         return;
     }
     
+    size_t chunkCount = chooseChunkCount(originalData.size());
+    
     bufferedInput.rewind();
-    std::map<byte, unsigned> frequencies = HuffmanTree::countFrequencies(bufferedInput);
+    std::map<byte, unsigned> frequencies = chunkCount > 1
+        ? HuffmanTree::countFrequencies(originalData, chunkCount)
+        : HuffmanTree::countFrequencies(bufferedInput);
     
     HuffmanTree huffmanTree;
     huffmanTree.buildFromFrequencies(frequencies);
@@ -385,6 +941,14 @@ void Encode(IInputStream& original, IOutputStream& compressed)
     
     BitWriter writer(compressed);
     
+    byte mode = MODE_SINGLE;
+    if (chunkCount > 1) {
+        mode = MODE_CHUNKED;
+    } else if (originalData.size() >= MIN_INTERLEAVED_SIZE) {
+        mode = MODE_INTERLEAVED;
+    }
+    writer.writeByte(mode);
+    
     size_t originalSize = originalData.size();
     writer.writeBits((originalSize >> 24) & 0xFF, 8);
     writer.writeBits((originalSize >> 16) & 0xFF, 8);
@@ -393,6 +957,16 @@ void Encode(IInputStream& original, IOutputStream& compressed)
     
     huffmanTree.serialize(writer);
     
+    if (mode == MODE_CHUNKED) {
+        encodeChunked(huffmanTree, originalData, chunkCount, writer, compressed);
+        return;
+    }
+    
+    if (mode == MODE_INTERLEAVED) {
+        encodeInterleaved(huffmanTree, originalData, writer, compressed);
+        return;
+    }
+    
     bufferedInput.rewind();
     huffmanTree.encode(bufferedInput, writer);
     
@@ -403,11 +977,12 @@ void Decode(IInputStream& compressed, IOutputStream& original)
 {
     BitReader reader(compressed);
     
-    unsigned originalSize = 0;
-    originalSize = (reader.readByte() << 24) | 
-                   (reader.readByte() << 16) | 
-                   (reader.readByte() << 8) | 
-                   reader.readByte();
+    byte mode = reader.readByte();
+    if (reader.isEndOfStream() || mode > MODE_INTERLEAVED) {
+        return;
+    }
+    
+    size_t originalSize = readUInt32(reader);
     
     HuffmanTree huffmanTree;
     huffmanTree.deserialize(reader);
@@ -416,5 +991,108 @@ void Decode(IInputStream& compressed, IOutputStream& original)
         return;
     }
     
-    huffmanTree.decode(reader, original, originalSize);
-}
\ No newline at end of file
+    if (mode == MODE_CHUNKED) {
+        decodeChunked(huffmanTree, reader, compressed, original, originalSize);
+        return;
+    }
+    
+    if (mode == MODE_INTERLEAVED) {
+        decodeInterleaved(huffmanTree, reader, compressed, original, originalSize);
+        return;
+    }
+    
+    decodeSingle(huffmanTree, reader, compressed, original, originalSize);
+}
+
+#ifdef HUFFMAN_BENCH
+/*
+Замер декодирования одного потока (HuffmanTree::decode) и четырёх
+чередующихся (HuffmanTree::decodeInterleaved) на BENCH_SIZE байтах.
+Функции вызываются напрямую, без разбора заголовка и записи байтов
+в IOutputStream. Данные: геометрическое распределение байтов с
+параметром p и равномерно случайные байты. Печатается лучшее время
+из BENCH_REPEATS запусков.
+Сборка: g++ -O2 -std=c++17 -pthread -DHUFFMAN_BENCH task_5.cpp
+*/
+#define BENCH_SIZE (8 << 20)
+#define BENCH_REPEATS 15
+
+double benchBest(const std::vector<byte>& expected, std::vector<byte>& output,
+                 const std::function<void(std::vector<byte>&)>& decodeInto) {
+    double best = 0;
+    
+    for (int repeat = 0; repeat < BENCH_REPEATS; repeat++) {
+        std::fill(output.begin(), output.end(), 0);
+        
+        auto start = std::chrono::steady_clock::now();
+        decodeInto(output);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        
+        if (output != expected) {
+            return 0;
+        }
+        if (repeat == 0 || elapsed.count() < best) {
+            best = elapsed.count();
+        }
+    }
+    
+    return expected.size() / best / 1e6;
+}
+
+void runDecodeBench(std::ostream& out) {
+    std::mt19937 random(9);
+    out << std::fixed << std::setprecision(2);
+    out << "MB/s: single stream / " << INTERLEAVED_STREAMS << " interleaved streams\n";
+    
+    for (double p : { 0.08, 0.3, 1.0 }) {
+        std::geometric_distribution<int> geometric(p);
+        std::vector<byte> data(BENCH_SIZE);
+        for (byte& value : data) {
+            value = static_cast<byte>(p < 1 ? geometric(random) : random());
+        }
+        
+        std::map<byte, unsigned> frequencies;
+        for (byte value : data) {
+            frequencies[value]++;
+        }
+        
+        HuffmanTree huffmanTree;
+        huffmanTree.buildFromFrequencies(frequencies);
+        
+        std::vector<byte> single;
+        {
+            ByteVectorOutputStream singleOutput(single);
+            BitWriter singleWriter(singleOutput);
+            huffmanTree.encodeRange(data.data(), data.data() + data.size(), singleWriter);
+        }
+        
+        std::vector<std::vector<byte>> streams;
+        std::vector<size_t> streamBits;
+        huffmanTree.encodeInterleaved(data, streams, streamBits);
+        
+        std::vector<byte> output(data.size());
+        
+        double singleSpeed = benchBest(data, output, [&](std::vector<byte>& decoded) {
+            MemoryBitReader reader(single.data(), single.data() + single.size());
+            huffmanTree.decode(reader, decoded);
+        });
+        
+        double interleavedSpeed = benchBest(data, output, [&](std::vector<byte>& decoded) {
+            std::vector<MemoryBitReader> readers;
+            for (const std::vector<byte>& stream : streams) {
+                readers.emplace_back(stream.data(), stream.data() + stream.size());
+            }
+            huffmanTree.decodeInterleaved(readers, decoded);
+        });
+        
+        out << (p < 1 ? "geometric p=" : "random p=") << p << ", " << single.size() * 100.0 / data.size()
+            << "% of input: " << singleSpeed << " / " << interleavedSpeed
+            << ", x" << interleavedSpeed / singleSpeed << "\n";
+    }
+}
+
+int main() {
+    runDecodeBench(std::cout);
+    return 0;
+}
+#endif
@@ -23,6 +23,154 @@ TODO: отправлять в BWT батчи исходного потока
 #include <unordered_map>
 #include <algorithm>
 #include <string>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE
+#endif
+
+enum class DecodeStatus {
+    Ok,
+    BadHeader,
+    CorruptStream,
+    CorruptBlock,
+};
+
+/*
+CRC32C (полином Castagnoli). Блоки памяти считаются инструкцией crc32 из SSE4.2,
+если процессор её поддерживает, иначе slicing-by-8 по таблицам.
+Побайтовое обновление используется потоками-обёртками ниже.
+Таблицы строятся при компиляции, поэтому их можно читать из любых потоков.
+*/
+const uint32_t CRC32C_POLY = 0x82F63B78;
+
+struct Crc32cTable {
+    uint32_t entries[8][256];
+
+    constexpr Crc32cTable() : entries() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+            }
+            entries[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                uint32_t prev = entries[k - 1][i];
+                entries[k][i] = (prev >> 8) ^ entries[0][prev & 0xFF];
+            }
+        }
+    }
+
+    constexpr const uint32_t* operator[](int k) const {
+        return entries[k];
+    }
+};
+
+namespace {
+    constexpr Crc32cTable crc32cTable;
+}
+
+inline uint32_t crc32cUpdateByte(uint32_t state, byte value) {
+    return (state >> 8) ^ crc32cTable[0][(state ^ value) & 0xFF];
+}
+
+uint32_t crc32cSoftware(uint32_t state, const byte* data, size_t size) {
+    while (size >= 8) {
+        uint32_t low = state ^ (data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24));
+        uint32_t high = data[4] | (data[5] << 8) | (data[6] << 16) | (static_cast<uint32_t>(data[7]) << 24);
+
+        state = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+                crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+                crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+                crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+
+        data += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        state = crc32cUpdateByte(state, *data++);
+    }
+
+    return state;
+}
+
+#ifdef CRC32C_HARDWARE
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t state, const byte* data, size_t size) {
+    uint64_t state64 = state;
+    while (size >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        state64 = _mm_crc32_u64(state64, word);
+        data += 8;
+        size -= 8;
+    }
+
+    state = static_cast<uint32_t>(state64);
+    while (size-- > 0) {
+        state = _mm_crc32_u8(state, *data++);
+    }
+
+    return state;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const byte* data, size_t size) {
+#ifdef CRC32C_HARDWARE
+    static const bool hasHardwareCrc = __builtin_cpu_supports("sse4.2");
+    if (hasHardwareCrc) {
+        return ~crc32cHardware(~crc, data, size);
+    }
+#endif
+
+    return ~crc32cSoftware(~crc, data, size);
+}
+
+// Считает контрольную сумму всех байтов, проходящих через поток
+class ChecksumOutputStream : public IOutputStream {
+private:
+    IOutputStream& output;
+    uint32_t state;
+
+public:
+    ChecksumOutputStream(IOutputStream& out) : output(out), state(0xFFFFFFFF) {}
+
+    void Write(byte value) override {
+        state = crc32cUpdateByte(state, value);
+        output.Write(value);
+    }
+
+    uint32_t checksum() const {
+        return ~state;
+    }
+};
+
+class ChecksumInputStream : public IInputStream {
+private:
+    IInputStream& input;
+    uint32_t state;
+
+public:
+    ChecksumInputStream(IInputStream& in) : input(in), state(0xFFFFFFFF) {}
+
+    bool Read(byte& value) override {
+        if (!input.Read(value)) {
+            return false;
+        }
+        state = crc32cUpdateByte(state, value);
+        return true;
+    }
+
+    uint32_t checksum() const {
+        return ~state;
+    }
+};
 
 std::vector<byte> moveToFrontEncode(const std::vector<byte>& input) {
     std::vector<byte> alphabet(256);
@@ -128,6 +276,8 @@ public:
         if (bitsInBuffer > 0) {
             buffer <<= (8 - bitsInBuffer);
             output.Write(buffer);
+            buffer = 0;
+            bitsInBuffer = 0;
         }
     }
     
@@ -178,6 +328,10 @@ public:
         return readBits(8);
     }
     
+    void alignToByte() {
+        bitsInBuffer = 0;
+    }
+    
     bool isEndOfStream() const {
         return endOfStream;
     }
@@ -370,29 +524,44 @@ void writeTree(HuffmanNode* node, BitWriter& writer) {
     }
 }
 
-HuffmanNode* readTree(BitReader& reader) {
-    if (reader.isEndOfStream()) {
+void freeHuffmanTree(HuffmanNode* node) {
+    if (node == nullptr) return;
+    
+    freeHuffmanTree(node->left);
+    freeHuffmanTree(node->right);
+    delete node;
+}
+
+// В дереве из 256 листьев не больше 511 узлов, этим же ограничена глубина рекурсии
+const int MAX_TREE_NODES = 511;
+
+// Возвращает nullptr, если дерево оборвано, не полно или больше MAX_TREE_NODES узлов
+HuffmanNode* readTree(BitReader& reader, int& nodesLeft) {
+    if (reader.isEndOfStream() || nodesLeft == 0) {
         return nullptr;
     }
+    nodesLeft--;
     
     bool isLeaf = reader.readBit();
     
     if (isLeaf) {
         byte value = reader.readByte();
         return new HuffmanNode(value, 0); 
-    } else {
-        HuffmanNode* left = readTree(reader);
-        HuffmanNode* right = readTree(reader);
-        return new HuffmanNode(0, left, right);
     }
+    
+    HuffmanNode* left = readTree(reader, nodesLeft);
+    HuffmanNode* right = left ? readTree(reader, nodesLeft) : nullptr;
+    if (right == nullptr) {
+        freeHuffmanTree(left);
+        return nullptr;
+    }
+    
+    return new HuffmanNode(0, left, right);
 }
 
-void freeHuffmanTree(HuffmanNode* node) {
-    if (node == nullptr) return;
-    
-    freeHuffmanTree(node->left);
-    freeHuffmanTree(node->right);
-    delete node;
+HuffmanNode* readTree(BitReader& reader) {
+    int nodesLeft = MAX_TREE_NODES;
+    return readTree(reader, nodesLeft);
 }
 
 struct BWTResult {
@@ -522,6 +691,8 @@ void Encode(IInputStream& original, IOutputStream& compressed)
         return;
     }
     
+    uint32_t blockCrc = crc32c(0, originalData.data(), originalData.size());
+    
     std::vector<byte> rleInitialData = runLengthEncode(originalData);
     
     BWTResult bwtResult = bwtEncode(rleInitialData);
@@ -543,7 +714,8 @@ void Encode(IInputStream& original, IOutputStream& compressed)
     std::unordered_map<byte, std::string> codes;
     generateCodes(root, "", codes);
     
-    BitWriter writer(compressed);
+    ChecksumOutputStream checkedOutput(compressed);
+    BitWriter writer(checkedOutput);
     
     size_t originalSize = originalData.size();
     writer.writeBits((originalSize >> 24) & 0xFF, 8);
@@ -580,6 +752,11 @@ void Encode(IInputStream& original, IOutputStream& compressed)
     writer.writeBits((finalRleSize >> 8) & 0xFF, 8);
     writer.writeBits(finalRleSize & 0xFF, 8);
     
+    writer.writeBits((blockCrc >> 24) & 0xFF, 8);
+    writer.writeBits((blockCrc >> 16) & 0xFF, 8);
+    writer.writeBits((blockCrc >> 8) & 0xFF, 8);
+    writer.writeBits(blockCrc & 0xFF, 8);
+    
     writeTree(root, writer);
     
     rleInput.rewind();
@@ -594,56 +771,49 @@ void Encode(IInputStream& original, IOutputStream& compressed)
     
     writer.flush();
     
+    uint32_t streamCrc = checkedOutput.checksum();
+    compressed.Write((streamCrc >> 24) & 0xFF);
+    compressed.Write((streamCrc >> 16) & 0xFF);
+    compressed.Write((streamCrc >> 8) & 0xFF);
+    compressed.Write(streamCrc & 0xFF);
+    
     freeHuffmanTree(root);
 }
 
-void Decode(IInputStream& compressed, IOutputStream& original)
+// Байты читаются по очереди: порядок вычисления операндов в одном выражении не задан
+uint32_t readUInt32(BitReader& reader) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value = (value << 8) | reader.readByte();
+    }
+    return value;
+}
+
+// Проверяет контрольную сумму потока и CRC блока до того, как отдать данные наружу.
+// При любой ошибке в original ничего не пишется.
+DecodeStatus DecodeVerified(IInputStream& compressed, IOutputStream& original)
 {
-    BitReader reader(compressed);
-    
-    unsigned originalSize = 0;
-    originalSize = (reader.readByte() << 24) | 
-                   (reader.readByte() << 16) | 
-                   (reader.readByte() << 8) | 
-                   reader.readByte();
-    
-    int bwtIndex = 0;
-    bwtIndex = (reader.readByte() << 24) | 
-               (reader.readByte() << 16) | 
-               (reader.readByte() << 8) | 
-               reader.readByte();
-    
-    unsigned initialRleSize = 0;
-    initialRleSize = (reader.readByte() << 24) | 
-                     (reader.readByte() << 16) | 
-                     (reader.readByte() << 8) | 
-                     reader.readByte();
-    
-    bwtSize = (reader.readByte() << 24) | 
-              (reader.readByte() << 16) | 
-              (reader.readByte() << 8) | 
-              reader.readByte();
-    
-    unsigned mtfSize = 0;
-    mtfSize = (reader.readByte() << 24) | 
-              (reader.readByte() << 16) | 
-              (reader.readByte() << 8) | 
-              reader.readByte();
-    
-    unsigned finalRleSize = 0;
-    finalRleSize = (reader.readByte() << 24) | 
-                  (reader.readByte() << 16) | 
-                  (reader.readByte() << 8) | 
-                  reader.readByte();
+    ChecksumInputStream checkedInput(compressed);
+    BitReader reader(checkedInput);
+    
+    unsigned originalSize = readUInt32(reader);
+    int bwtIndex = static_cast<int>(readUInt32(reader));
+    unsigned initialRleSize = readUInt32(reader);
+    bwtSize = readUInt32(reader);
+    unsigned mtfSize = readUInt32(reader);
+    unsigned finalRleSize = readUInt32(reader);
+    uint32_t blockCrc = readUInt32(reader);
     
     if (originalSize == 0 || initialRleSize == 0 || bwtSize == 0 || mtfSize == 0 || finalRleSize == 0 || 
         bwtIndex < 0 || bwtIndex >= static_cast<int>(bwtSize)) {
-        return;
+        return DecodeStatus::BadHeader;
     }
     
+    // Кодер всегда пишет корень с двумя детьми, даже для одного символа
     HuffmanNode* root = readTree(reader);
-    if (root == nullptr) {
-        return;
+    if (root == nullptr || root->isLeaf()) {
+        freeHuffmanTree(root);
+        return DecodeStatus::BadHeader;
     }
     
     std::vector<byte> finalRleData;
@@ -658,7 +828,12 @@ void Decode(IInputStream& compressed, IOutputStream& original)
             current = current->left;
         }
         
-        if (current && current->isLeaf()) {
+        if (current == nullptr) {
+            freeHuffmanTree(root);
+            return DecodeStatus::CorruptStream;
+        }
+        
+        if (current->isLeaf()) {
             finalRleData.push_back(current->value);
             current = root;
         }
@@ -666,6 +841,22 @@ void Decode(IInputStream& compressed, IOutputStream& original)
 
     freeHuffmanTree(root);
     
+    reader.alignToByte();
+    uint32_t actualStreamCrc = checkedInput.checksum();
+    
+    uint32_t streamCrc = 0;
+    for (int i = 0; i < 4; ++i) {
+        byte value = 0;
+        if (!compressed.Read(value)) {
+            return DecodeStatus::CorruptStream;
+        }
+        streamCrc = (streamCrc << 8) | value;
+    }
+    
+    if (finalRleData.size() != finalRleSize || streamCrc != actualStreamCrc) {
+        return DecodeStatus::CorruptStream;
+    }
+    
     std::vector<byte> mtfData = runLengthDecode(finalRleData);
     
     std::vector<byte> bwtData = moveToFrontDecode(mtfData);
@@ -674,7 +865,19 @@ void Decode(IInputStream& compressed, IOutputStream& original)
     
     std::vector<byte> decodedData = runLengthDecode(initialRleData);
     
+    if (decodedData.size() != originalSize ||
+        crc32c(0, decodedData.data(), decodedData.size()) != blockCrc) {
+        return DecodeStatus::CorruptBlock;
+    }
+    
     for (byte b : decodedData) {
         original.Write(b);
     }
+    
+    return DecodeStatus::Ok;
+}
+
+void Decode(IInputStream& compressed, IOutputStream& original)
+{
+    DecodeVerified(compressed, original);
 }
\ No newline at end of file